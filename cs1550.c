@@ -9,26 +9,46 @@
 #define	FUSE_USE_VERSION 26
 
 #include <fuse.h>
+#ifdef CS1550_LOWLEVEL
+#include <fuse_lowlevel.h>
+#endif
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
-
-//size of a disk block
-#define	BLOCK_SIZE 512
+#include <unistd.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+//Blocks are chosen when an image is formatted, from MIN_BLOCK_SIZE to
+//MAX_BLOCK_SIZE, and the superblock says which. An image from before the
+//superblock has MIN_BLOCK_SIZE blocks
+#define	MIN_BLOCK_SIZE 512
+#define	MAX_BLOCK_SIZE 65536
+
+//size of a disk block on the mounted image
+static long cs1550_block_size = MIN_BLOCK_SIZE;
+#define	BLOCK_SIZE cs1550_block_size
 
 //we'll use 8.3 filenames
 #define	MAX_FILENAME 8
 #define	MAX_EXTENSION 3
 
-//How many files can there be in one directory?
-#define MAX_FILES_IN_DIR (BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + (MAX_EXTENSION + 1) + sizeof(size_t) + sizeof(long))
+//How many files fit in one block of a directory of a given block size?
+//The block ends in the link to the directory's next block
+#define FILES_IN_BLOCK(size) (((size) - sizeof(int) - sizeof(long)) / ((MAX_FILENAME + 1) + (MAX_EXTENSION + 1) + sizeof(size_t) + sizeof(long)))
+
+//How many files can there be in one block of a directory?
+#define MAX_FILES_IN_DIR FILES_IN_BLOCK(BLOCK_SIZE)
 
-//The attribute packed means to not align these things
+//The attribute packed means to not align these things. The struct is big
+//enough for the largest block; only the first BLOCK_SIZE bytes are on disk
 struct cs1550_directory_entry
 {
-	int nFiles;	//How many files are in this directory.
+	int nFiles;	//How many files are in this block of the directory.
 				//Needs to be less than MAX_FILES_IN_DIR
 
 	struct cs1550_file_directory
@@ -37,30 +57,41 @@ struct cs1550_directory_entry
 		char fext[MAX_EXTENSION + 1];	//extension (plus space for nul)
 		size_t fsize;					//file size
 		long nStartBlock;				//where the first block is on disk
-	} __attribute__((packed)) files[MAX_FILES_IN_DIR];	//There is an array of these
+	} __attribute__((packed)) files[FILES_IN_BLOCK(MAX_BLOCK_SIZE)];	//There is an array of these
 
-	//This is some space to get this to be exactly the size of the disk block.
-	//Don't use it for anything.  
-	char padding[BLOCK_SIZE - MAX_FILES_IN_DIR * sizeof(struct cs1550_file_directory) - sizeof(int)];
+	//This is some space to get this to be exactly the size of the largest
+	//disk block. Don't use it for anything.
+	char padding[MAX_BLOCK_SIZE - FILES_IN_BLOCK(MAX_BLOCK_SIZE) * sizeof(struct cs1550_file_directory) - sizeof(int)];
+
+	//A directory with more than MAX_FILES_IN_DIR files goes on in another
+	//block. The last long of the block is the next one, 0 in the last; use
+	//cs1550_next_block and cs1550_set_next_block to get at it
 } ;
 
 typedef struct cs1550_root_directory cs1550_root_directory;
 
-#define MAX_DIRS_IN_ROOT (BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + sizeof(long))
+#define DIRS_IN_BLOCK(size) (((size) - sizeof(int) - sizeof(long)) / ((MAX_FILENAME + 1) + sizeof(long)))
+
+#define MAX_DIRS_IN_ROOT DIRS_IN_BLOCK(BLOCK_SIZE)
 
 struct cs1550_root_directory
 {
-	int nDirectories;	//How many subdirectories are in the root
+	int nDirectories;	//How many subdirectories are in this block of the root
 						//Needs to be less than MAX_DIRS_IN_ROOT
 	struct cs1550_directory
 	{
 		char dname[MAX_FILENAME + 1];	//directory name (plus space for nul)
 		long nStartBlock;				//where the directory block is on disk
-	} __attribute__((packed)) directories[MAX_DIRS_IN_ROOT];	//There is an array of these
+	} __attribute__((packed)) directories[DIRS_IN_BLOCK(MAX_BLOCK_SIZE)];	//There is an array of these
 
-	//This is some space to get this to be exactly the size of the disk block.
-	//Don't use it for anything.  
-	char padding[BLOCK_SIZE - MAX_DIRS_IN_ROOT * sizeof(struct cs1550_directory) - sizeof(int)];
+	//This is some space to get this to be exactly the size of the largest
+	//disk block. Don't use it for anything.
+	char padding[MAX_BLOCK_SIZE - DIRS_IN_BLOCK(MAX_BLOCK_SIZE) * sizeof(struct cs1550_directory) - sizeof(int)];
+
+	//The root starts at the block the superblock names (block 0 on an image
+	//without one) and goes on in another block once it holds more than
+	//MAX_DIRS_IN_ROOT directories. Like a directory's, the link is the
+	//last long of the block, 0 in the last
 } ;
 
 
@@ -76,992 +107,5679 @@ struct cs1550_disk_block
 	long nNextBlock;
 
 	//And all the rest of the space in the block can be used for actual data
-	//storage.
-	char data[MAX_DATA_IN_BLOCK];
+	//storage. Only MAX_DATA_IN_BLOCK bytes of it are on disk
+	char data[MAX_BLOCK_SIZE - sizeof(long)];
 };
 
 typedef struct cs1550_disk_block cs1550_disk_block;
 
+//How many extents fit in one extent block of a given block size?
+#define EXTENTS_IN_BLOCK(size) (((size) - 2 * sizeof(long)) / (2 * sizeof(long)))
+
+#define MAX_EXTENTS_IN_BLOCK EXTENTS_IN_BLOCK(BLOCK_SIZE)
+
+//An extent-mapped file's directory entry holds minus the block number of
+//the first of these. Its data blocks hold nothing but data, BLOCK_SIZE
+//bytes of the file each
+struct cs1550_extent_block
+{
+	long nExtents;			//How many extents are in this block
+	long nNextBlock;		//the next extent block, 0 in the last
+
+	struct cs1550_extent
+	{
+		long nStartBlock;	//first block of the run
+		long nBlocks;		//how many blocks the run has
+	} extents[EXTENTS_IN_BLOCK(MAX_BLOCK_SIZE)];	//the file's runs, in file order
+
+	//This is some space to get this to be exactly the size of the largest
+	//disk block. Don't use it for anything.
+	char padding[MAX_BLOCK_SIZE - EXTENTS_IN_BLOCK(MAX_BLOCK_SIZE) * sizeof(struct cs1550_extent) - 2 * sizeof(long)];
+};
+
+typedef struct cs1550_extent_block cs1550_extent_block;
+
+//nMagic sits where the root's nDirectories would, and no root can have this
+//many directories in a block, so an image without a superblock is told apart
+#define	CS1550_MAGIC 0x15501550
+
+//Layout versions. Version 1 files are all linked lists of blocks. Version 2
+//may also have extent-mapped files, and new files are made that way
+#define	CS1550_VERSION_LINKED 1
+#define	CS1550_VERSION_EXTENTS 2
+
+//The start of block 0 of a formatted image; the rest of the block is zero.
+//It records where everything else lives: the root follows it in block 1
+//and the bitmap takes the tail of the image
+struct cs1550_superblock
+{
+	int nMagic;				//CS1550_MAGIC
+	int nVersion;			//layout version, CS1550_VERSION_*
+	long nBlockSize;		//bytes per block
+	long nBlocks;			//blocks in the image
+	long nBitmapStart;		//first block of the free block bitmap
+	long nBitmapBlocks;		//how many blocks the bitmap takes
+	long nRootBlock;		//first block of the root directory
+} ;
+
+typedef struct cs1550_superblock cs1550_superblock;
+
 
 /* Added functions below */
-static long cs1550_find_free_block()
+
+//number of blocks at the tail of an image without a superblock that hold
+//the free block bitmap
+#define	BITMAP_BLOCKS 3
+
+//.disk is opened once before fuse_main and every operation goes through this
+//descriptor with pread/pwrite instead of reopening the image per call
+static int cs1550_disk_fd = -1;
+
+//size of the file system in blocks, from the superblock (or the size of .disk
+//for an image without one)
+static long cs1550_disk_blocks = 0;
+
+//where the root and the bitmap live. The bitmap bit for block n is bit n-1,
+//since block 0 (the superblock, or the root on an old image) is never handed
+//out by the allocator
+static long cs1550_root_block = 0;
+static long cs1550_bitmap_block = 0;
+static long cs1550_bitmap_blocks = 0;
+
+//first block of the bitmap. On an image with a superblock it is wherever
+//nBitmapStart says (format puts it at the tail); on an image without one it
+//is the last BITMAP_BLOCKS blocks. Either way it covers blocks 1 up to it
+static long cs1550_bitmap_start(void)
+{
+	return cs1550_bitmap_block;
+}
+
+//the link to the next block of a directory or of the root, which is the
+//last long of the block whatever the block size
+static long cs1550_next_block(const void *block)
 {
+	long next;
 
-	printf("cs1550_find_free_block()\n");
-	FILE * disk;
-	disk = fopen(".disk", "rb+");
+	memcpy(&next, (const char *) block + BLOCK_SIZE - sizeof(long), sizeof(long));
+	return next;
+}
 
-	if(disk == NULL)
-	{
-		printf("open disk error\n");
-		return -1;
-	}
+static void cs1550_set_next_block(void *block, long next)
+{
+	memcpy((char *) block + BLOCK_SIZE - sizeof(long), &next, sizeof(long));
+}
+
+//room for one block of the mounted image, to read one of the structs above
+//into. They are sized for the largest block, too big to put on the stack
+//for every call; only the first BLOCK_SIZE bytes are ever touched. free()
+//it after
+static void *cs1550_block_alloc(void)
+{
+	return malloc(BLOCK_SIZE);
+}
 
-	int seek_ret = fseek(disk, -1* BLOCK_SIZE * 3, SEEK_END);
+//every block size an image can be formatted with, for code that is written
+//out once per size
+#define	CS1550_BLOCK_SIZES(X) X(512) X(1024) X(2048) X(4096) X(8192) X(16384) X(32768) X(65536)
+
+/*
+ * Which block of a file, counting from 0, holds byte offset, and where in
+ * that block it falls. The read and write paths do this for every call, and
+ * with the block size only known at mount, dividing by MAX_DATA_IN_BLOCK
+ * would be a hardware divide. There is a case for each block size instead,
+ * each dividing by a constant that the compiler turns into a multiply and a
+ * shift. The superblock's size picks the case at mount and it never changes
+ * after, so the branch always predicts.
+ */
+static long cs1550_data_pos(off_t offset, size_t *byte)
+{
+	long index;
 
-	if(seek_ret<0)
+	switch(BLOCK_SIZE)
 	{
-		printf("seek error\n");
-		return -1;
+#define	CS1550_DATA_POS(size) \
+	case size: \
+		index = (size_t) offset / ((size) - sizeof(long)); \
+		break;
+	CS1550_BLOCK_SIZES(CS1550_DATA_POS)
+#undef	CS1550_DATA_POS
+	default:
+		index = (size_t) offset / MAX_DATA_IN_BLOCK;
 	}
+	if(byte != NULL)
+		*byte = offset - index * MAX_DATA_IN_BLOCK;
+	return index;
+}
 
-	unsigned char bits[BLOCK_SIZE*3];
+//how many data blocks size bytes take
+static long cs1550_data_blocks(off_t size)
+{
+	return cs1550_data_pos(size + MAX_DATA_IN_BLOCK - 1, NULL);
+}
+
+/*
+ * The same for an extent-mapped file, whose blocks are all data. The block
+ * size is a power of two, so with a case per size each divide is a shift.
+ */
+static long cs1550_block_pos(off_t offset, size_t *byte)
+{
+	long index;
 
-	int read_ret = fread(bits, BLOCK_SIZE*3, 1, disk);
-	if(read_ret <0)
+	switch(BLOCK_SIZE)
 	{
-		printf("read_ret = %d\n", read_ret);
-		return -1;
+#define	CS1550_BLOCK_POS(size) \
+	case size: \
+		index = (size_t) offset / (size); \
+		break;
+	CS1550_BLOCK_SIZES(CS1550_BLOCK_POS)
+#undef	CS1550_BLOCK_POS
+	default:
+		index = (size_t) offset / BLOCK_SIZE;
 	}
+	if(byte != NULL)
+		*byte = offset & (BLOCK_SIZE - 1);
+	return index;
+}
 
-	seek_ret = fseek(disk, -1* BLOCK_SIZE * 3, SEEK_END);
-	if(seek_ret<0)
+//how many blocks of an extent-mapped file size bytes take
+static long cs1550_block_count(off_t size)
+{
+	return cs1550_block_pos(size + BLOCK_SIZE - 1, NULL);
+}
+
+//read count whole blocks starting at block straight from .disk into buf
+static int cs1550_dev_read(long block, long count, void *buf)
+{
+	size_t len = (size_t) count * BLOCK_SIZE;
+	ssize_t ret;
+
+	if(block < 0 || block + count > cs1550_disk_blocks)
 	{
-		printf("seek error\n");
-		return -1;
+		printf("read of block %ld is outside the disk\n", block);
+		return -EIO;
 	}
 
-	long i;
-	printf("searching bitmap for free block\n");
-	for(i=0; i<BLOCK_SIZE*3; i++)
+	ret = pread(cs1550_disk_fd, buf, len, (off_t) block * BLOCK_SIZE);
+	if(ret < 0)
+		return -errno;
+	if((size_t) ret != len)
+		return -EIO;
+	return 0;
+}
+
+//write count whole blocks starting at block straight from buf to .disk
+static int cs1550_dev_write(long block, long count, const void *buf)
+{
+	size_t len = (size_t) count * BLOCK_SIZE;
+	ssize_t ret;
+
+	if(block < 0 || block + count > cs1550_disk_blocks)
 	{
-		printf("i:%d\n", i);
-		unsigned char and = 1;
-		int j;
-		for(j=0 ; j<8; j++)
-		{
-			if((bits[i] & and) == 0)
-			{
-				printf("found a free block, i = %d, j = %d\n",i,j);
-				bits[i]|=and; // set the bit to 1
-				fwrite(bits, BLOCK_SIZE*3, 1, disk);
-				fclose(disk);
-				return i*8 + j +1;
-			}
-			and*=2;
-		}
+		printf("write of block %ld is outside the disk\n", block);
+		return -EIO;
 	}
-	printf("didn't find a free bit\n");
-	fclose(disk);
-	return -1;
+
+	ret = pwrite(cs1550_disk_fd, buf, len, (off_t) block * BLOCK_SIZE);
+	if(ret < 0)
+		return -errno;
+	if((size_t) ret != len)
+		return -EIO;
+	return 0;
 }
 
-static int cs1550_mark_blocks_free(long block){
+/*
+ * Buffer cache. A fixed pool of block buffers sits between the syscalls and
+ * .disk, found by block number through a hash table and recycled in least
+ * recently used order. Writes only dirty the buffer; dirty buffers go back
+ * to the disk when they are evicted or when the cache is flushed (flush,
+ * fsync and unmount).
+ *
+ * The cache is shared with the readahead thread, so it is guarded by
+ * cs1550_cache_lock. A buffer whose contents are still being read in is
+ * marked busy; anyone who wants it waits on cs1550_cache_io_done, and it is
+ * never chosen for eviction. Disk reads happen with the lock dropped.
+ */
 
-  printf("freeing blocks\n");
-  if(block <=0){
-    printf("error\n");
-    return -1;
-  }
+//default cache budget, overridden with -o cache_kb=N
+#define	CACHE_DEFAULT_KB 4096
+
+struct cs1550_buf
+{
+	long block;						//block held here, -1 if unused
+	int dirty;						//needs writing back before reuse
+	int busy;						//being read in, data not valid yet
+	struct cs1550_buf *hash_next;	//next buffer in the same hash bucket
+	struct cs1550_buf *lru_prev;	//towards the most recently used
+	struct cs1550_buf *lru_next;	//towards the least recently used
+	char *data;						//BLOCK_SIZE bytes
+};
 
-  FILE * disk;
-  disk = fopen(".disk", "rb+");
+typedef struct cs1550_buf cs1550_buf;
 
-  unsigned char bits[BLOCK_SIZE*3];
+static cs1550_buf *cs1550_bufs = NULL;
+static char *cs1550_buf_data = NULL;
+static long cs1550_nbufs = 0;
 
-  fseek(disk, -1 * BLOCK_SIZE * 3, SEEK_END);
+static cs1550_buf **cs1550_buf_hash = NULL;
+static unsigned long cs1550_buf_hash_mask = 0;
 
-  fread(bits, BLOCK_SIZE * 3, 1, disk);
+//most and least recently used ends of the LRU list
+static cs1550_buf *cs1550_lru_head = NULL;
+static cs1550_buf *cs1550_lru_tail = NULL;
 
+static pthread_mutex_t cs1550_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cs1550_cache_io_done = PTHREAD_COND_INITIALIZER;
 
-  fseek(disk, BLOCK_SIZE * block, SEEK_SET);
+static unsigned long cs1550_buf_hashfn(long block)
+{
+	return ((unsigned long) block * 2654435761UL) & cs1550_buf_hash_mask;
+}
 
-  cs1550_disk_block file;
-  fread((void*)&file, sizeof(cs1550_disk_block), 1, disk);
+static void cs1550_lru_unlink(cs1550_buf *b)
+{
+	if(b->lru_prev != NULL)
+		b->lru_prev->lru_next = b->lru_next;
+	else
+		cs1550_lru_head = b->lru_next;
+	if(b->lru_next != NULL)
+		b->lru_next->lru_prev = b->lru_prev;
+	else
+		cs1550_lru_tail = b->lru_prev;
+	b->lru_prev = b->lru_next = NULL;
+}
 
+static void cs1550_lru_push(cs1550_buf *b)
+{
+	b->lru_prev = NULL;
+	b->lru_next = cs1550_lru_head;
+	if(cs1550_lru_head != NULL)
+		cs1550_lru_head->lru_prev = b;
+	cs1550_lru_head = b;
+	if(cs1550_lru_tail == NULL)
+		cs1550_lru_tail = b;
+}
 
-  //we're freeing everything this points to too
-  int i;  //which byte
-  int j;  //which bit
-  while(file.nNextBlock > 0){
-    //free current block
-    i = block / 8;
-    j = block % 8;
-    if(j==0)
-      bits[i]&=0xFE;
-    else if(j==1)
-      bits[i]&=0xFD;
-    else if(j==2)
-      bits[i]&=0xFB;
-    else if(j==3)
-      bits[i]&=0xF7;
-    else if(j==4)
-      bits[i]&=0xEF;
-    else if(j==5)
-      bits[i]&=0xDF;
-    else if(j==6)
-      bits[i]&=0xBF;
-    else if(j==7)
-      bits[i]&=0x7F;
-    else
-      printf("error\n");
-    //get next block
-    block = file.nNextBlock;
-    fseek(disk, BLOCK_SIZE * block, SEEK_SET);
-    fread((void*)&file, sizeof(cs1550_disk_block), 1, disk);
-  }
+static void cs1550_hash_remove(cs1550_buf *b)
+{
+	cs1550_buf **p = &cs1550_buf_hash[cs1550_buf_hashfn(b->block)];
 
-  //free current block
-  i = block / 8;
-  j = block % 8;
-  if(j==0)
-      bits[i]&=0xFE;
-    else if(j==1)
-      bits[i]&=0xFD;
-    else if(j==2)
-      bits[i]&=0xFB;
-    else if(j==3)
-      bits[i]&=0xF7;
-    else if(j==4)
-      bits[i]&=0xEF;
-    else if(j==5)
-      bits[i]&=0xDF;
-    else if(j==6)
-      bits[i]&=0xBF;
-    else if(j==7)
-      bits[i]&=0x7F;
-    else
-      printf("error\n");
-
-  fseek(disk, -1 * BLOCK_SIZE * 3, SEEK_END);
-  fwrite((void*)bits, BLOCK_SIZE*3, 1, disk);
-  fclose(disk);
-  return 0;
+	while(*p != NULL && *p != b)
+		p = &(*p)->hash_next;
+	if(*p == b)
+		*p = b->hash_next;
+	b->hash_next = NULL;
 }
 
-static int cs1550_find_dir_loc(char* dir)
+static int cs1550_cache_init(unsigned long kb)
 {
-	FILE *disk = fopen(".disk","rb");
-	if(disk == NULL)
-	{
-		printf("error opening .disk\n");
-		return -1;
-	}
-	printf("opened .disk\n");
+	unsigned long nbuckets = 1;
+	long i;
 
-	cs1550_root_directory *root = malloc(sizeof(cs1550_root_directory));
+	cs1550_nbufs = (long) (kb * 1024 / BLOCK_SIZE);
+	if(cs1550_nbufs < 16)
+		cs1550_nbufs = 16;
+	while(nbuckets < (unsigned long) cs1550_nbufs)
+		nbuckets <<= 1;
 
-	int read_ret;
-	read_ret = fread((void*)root, sizeof(cs1550_root_directory), 1, disk);
-	if(read_ret<=0)
+	cs1550_bufs = calloc(cs1550_nbufs, sizeof(cs1550_buf));
+	cs1550_buf_data = malloc((size_t) cs1550_nbufs * BLOCK_SIZE);
+	cs1550_buf_hash = calloc(nbuckets, sizeof(cs1550_buf *));
+	if(cs1550_bufs == NULL || cs1550_buf_data == NULL || cs1550_buf_hash == NULL)
 	{
-		printf("error reading the root directory\n");
-		return -1;
+		printf("could not allocate a %lu KiB buffer cache\n", kb);
+		return -ENOMEM;
 	}
-	printf("read the root\n");
+	cs1550_buf_hash_mask = nbuckets - 1;
 
-	int i;
-	for(i=0; i<MAX_DIRS_IN_ROOT; i++)
+	for(i = 0; i < cs1550_nbufs; i++)
 	{
-		char *name = "";
-		if(root->directories!=NULL)
-			name = root->directories[i].dname;
-		else
-			continue;
-		printf("we're looking at dname %s\n", name);
-		if(strcmp(name,dir)==0)
-		{
-			fclose(disk);
-			printf("found dir: %s\n", dir);
-			return i;
-		}
+		cs1550_bufs[i].block = -1;
+		cs1550_bufs[i].data = cs1550_buf_data + (size_t) i * BLOCK_SIZE;
+		cs1550_lru_push(&cs1550_bufs[i]);
 	}
-	fclose(disk);
-	printf("did not find dir: %s", dir);
-	return -ENOENT; //not found
+	return 0;
 }
 
+static cs1550_buf *cs1550_cache_lookup(long block)
+{
+	cs1550_buf *b = cs1550_buf_hash[cs1550_buf_hashfn(block)];
+
+	while(b != NULL && b->block != block)
+		b = b->hash_next;
+	return b;
+}
 
-static int cs1550_find_file_loc(int dir_loc, char * file, size_t * fsize)
+static int cs1550_buf_writeback(cs1550_buf *b)
 {
-	printf("cs1550_find_file_loc\n");
+	int ret;
 
-	FILE * disk = fopen(".disk","rb");
-	if(disk==NULL)
-	{
-		printf("error opening .disk \n");
-		return -1;
-	}
+	if(!b->dirty)
+		return 0;
+	ret = cs1550_dev_write(b->block, 1, b->data);
+	if(ret == 0)
+		b->dirty = 0;
+	return ret;
+}
+
+//take the least recently used idle buffer and rebind it to block; NULL if
+//every buffer is busy
+static cs1550_buf *cs1550_cache_claim(long block)
+{
+	cs1550_buf *b = cs1550_lru_tail;
 
-	cs1550_root_directory root;
+	while(b != NULL && b->busy)
+		b = b->lru_prev;
+	if(b == NULL)
+		return NULL;
 
-	int read_ret;
-	read_ret = fread((void*)&root, sizeof(cs1550_root_directory), 1, disk);
-	if(read_ret<=0)
+	if(b->block >= 0)
 	{
-		printf("error reading the root directory");
-		return -1;
+		if(cs1550_buf_writeback(b) < 0)
+			return NULL;
+		cs1550_hash_remove(b);
 	}
 
-	long block = root.directories[dir_loc].nStartBlock;
+	b->block = block;
+	b->dirty = 0;
+	b->hash_next = cs1550_buf_hash[cs1550_buf_hashfn(block)];
+	cs1550_buf_hash[cs1550_buf_hashfn(block)] = b;
+	return b;
+}
 
-	fseek(disk, block*BLOCK_SIZE, SEEK_SET);
-	printf("seeked to dir entry block\n");
+//forget a buffer whose read failed
+static void cs1550_cache_drop(cs1550_buf *b)
+{
+	cs1550_hash_remove(b);
+	b->block = -1;
+	b->dirty = 0;
+	b->busy = 0;
+}
 
-	cs1550_directory_entry  entry;
+/*
+ * Get the buffer for block, reading it in unless the caller will overwrite
+ * it. Called and returns with cs1550_cache_lock held.
+ */
+static cs1550_buf *cs1550_cache_get(long block, int fill)
+{
+	cs1550_buf *b;
 
-	read_ret = fread((void*)&entry, sizeof(cs1550_directory_entry), 1, disk);
-	if(read_ret<=0)
+	if(block < 0 || block >= cs1550_disk_blocks)
 	{
-		printf("error reading directory entry");
-		return -1;
+		printf("block %ld is outside the disk\n", block);
+		return NULL;
 	}
-	printf("read entry\n");
 
-	int i;
-	for(i=0; i<MAX_FILES_IN_DIR; i++)
+	while(1)
 	{
-		char * name;
-		if(entry.files!=NULL)
+		b = cs1550_cache_lookup(block);
+		if(b != NULL && b->busy)
+		{
+			pthread_cond_wait(&cs1550_cache_io_done, &cs1550_cache_lock);
+			continue;
+		}
+		if(b != NULL)
+			break;
+
+		b = cs1550_cache_claim(block);
+		if(b == NULL)
+		{
+			pthread_cond_wait(&cs1550_cache_io_done, &cs1550_cache_lock);
+			continue;
+		}
+		if(fill)
 		{
-			name = entry.files[i].fname;
-			printf("looking at %s\n",name);
-			if(strcmp(name,file)==0)
+			int ret;
+
+			b->busy = 1;
+			pthread_mutex_unlock(&cs1550_cache_lock);
+			ret = cs1550_dev_read(block, 1, b->data);
+			pthread_mutex_lock(&cs1550_cache_lock);
+			b->busy = 0;
+			pthread_cond_broadcast(&cs1550_cache_io_done);
+			if(ret < 0)
 			{
-				printf("found file\n");
-				fclose(disk);
-				if(fsize!=NULL)
-					*fsize = entry.files[i].fsize;
-				printf("returning %d", i);
-				return i;
+				cs1550_cache_drop(b);
+				return NULL;
 			}
 		}
+		break;
 	}
-	fclose(disk);
-	return -ENOENT;
+
+	cs1550_lru_unlink(b);
+	cs1550_lru_push(b);
+	return b;
 }
 
-/* End added functions */
+static int cs1550_buf_cmp(const void *a, const void *b)
+{
+	long x = (*(cs1550_buf * const *) a)->block;
+	long y = (*(cs1550_buf * const *) b)->block;
 
-/*
- * Called whenever the system wants to know the file attributes, including
- * simply whether the file exists or not. 
- *
- * man -s 2 stat will show the fields of a stat structure
- */
-static int cs1550_getattr(const char *path, struct stat *stbuf)
+	return (x > y) - (x < y);
+}
+
+//write every dirty buffer back to .disk in block order
+static int cs1550_cache_flush(void)
 {
-	int res = 0;
+	cs1550_buf **dirty;
+	long i, n = 0;
+	int ret = 0;
 
-	memset(stbuf, 0, sizeof(struct stat));
+	if(cs1550_bufs == NULL)
+		return 0;
 
-	char directory[MAX_FILENAME+1];
-	char filename[MAX_FILENAME+1];
-	char extension[MAX_EXTENSION+1];
+	dirty = malloc(cs1550_nbufs * sizeof(cs1550_buf *));
+	if(dirty == NULL)
+		return -ENOMEM;
 
-	// Set to empty
-	memset(directory, 0, MAX_FILENAME+1);
-	memset(filename, 0, MAX_FILENAME+1);
-	memset(extension, 0, MAX_EXTENSION+1);
-   
-	//is path the root dir?
-	if (strcmp(path, "/") == 0)
+	pthread_mutex_lock(&cs1550_cache_lock);
+	for(i = 0; i < cs1550_nbufs; i++)
+		if(cs1550_bufs[i].dirty)
+			dirty[n++] = &cs1550_bufs[i];
+	qsort(dirty, n, sizeof(cs1550_buf *), cs1550_buf_cmp);
+
+	for(i = 0; i < n; i++)
+		if(cs1550_buf_writeback(dirty[i]) < 0)
+			ret = -EIO;
+	pthread_mutex_unlock(&cs1550_cache_lock);
+
+	free(dirty);
+	return ret;
+}
+
+static void cs1550_cache_destroy(void)
+{
+	free(cs1550_bufs);
+	free(cs1550_buf_data);
+	free(cs1550_buf_hash);
+	cs1550_bufs = NULL;
+	cs1550_buf_data = NULL;
+	cs1550_buf_hash = NULL;
+	cs1550_lru_head = cs1550_lru_tail = NULL;
+	cs1550_nbufs = 0;
+}
+
+//block sizes an image can be formatted with: powers of two from
+//MIN_BLOCK_SIZE to MAX_BLOCK_SIZE
+static int cs1550_block_size_ok(long size)
+{
+	return size >= MIN_BLOCK_SIZE && size <= MAX_BLOCK_SIZE
+			&& (size & (size - 1)) == 0;
+}
+
+//new files are extent-mapped; set from the superblock's version at mount
+static int cs1550_extents = 0;
+
+/*
+ * Lay a fresh file system of block_size blocks over an image of size bytes:
+ * the superblock, an empty root, and a bitmap just big enough to cover every
+ * block in between with the root's block already marked used. With extents
+ * set the image is made at version 2, so its files are extent-mapped.
+ */
+static int cs1550_format(off_t size, long block_size, int extents)
+{
+	cs1550_superblock sb;
+	char *block;
+	long nblocks = size / block_size;
+	long nbitmap, i;
+	int ret = 0;
+
+	if(!cs1550_block_size_ok(block_size) || nblocks < 4)
 	{
-		stbuf->st_mode = S_IFDIR | 0755;
-		stbuf->st_nlink = 2;
-		return 0;
+		printf("can't format with %ld byte blocks\n", block_size);
+		return -EINVAL;
 	}
-	else
+	cs1550_block_size = block_size;
+	cs1550_disk_blocks = nblocks;
+
+	//bits for blocks 1 .. nblocks - nbitmap - 1
+	nbitmap = (nblocks - 1 + BLOCK_SIZE * 8) / (BLOCK_SIZE * 8 + 1);
+
+	memset(&sb, 0, sizeof(sb));
+	sb.nMagic = CS1550_MAGIC;
+	sb.nVersion = extents ? CS1550_VERSION_EXTENTS : CS1550_VERSION_LINKED;
+	sb.nBlockSize = BLOCK_SIZE;
+	sb.nBlocks = nblocks;
+	sb.nBitmapStart = nblocks - nbitmap;
+	sb.nBitmapBlocks = nbitmap;
+	sb.nRootBlock = 1;
+
+	block = calloc(1, BLOCK_SIZE);
+	if(block == NULL)
+		return -ENOMEM;
+	for(i = sb.nBitmapStart + 1; i < nblocks && ret == 0; i++)
+		ret = cs1550_dev_write(i, 1, block);
+	block[0] = 1;	//bit 0 is block 1, the root
+	if(ret == 0)
+		ret = cs1550_dev_write(sb.nBitmapStart, 1, block);
+	block[0] = 0;
+	if(ret == 0)
+		ret = cs1550_dev_write(sb.nRootBlock, 1, block);
+	//the superblock goes last, so a format cut short is redone next time
+	memcpy(block, &sb, sizeof(sb));
+	if(ret == 0)
+		ret = cs1550_dev_write(0, 1, block);
+	free(block);
+	if(ret == 0)
+		printf("formatted %ld blocks of %ld bytes, bitmap at %ld\n",
+				nblocks, BLOCK_SIZE, sb.nBitmapStart);
+	return ret;
+}
+
+/*
+ * Work out the geometry of an image of size bytes from the start of its
+ * block 0. An image that starts with a superblock says where everything is.
+ * One whose block 0 is an empty root holds nothing, so it is formatted with
+ * a superblock and block_size blocks. Anything else is the original layout:
+ * MIN_BLOCK_SIZE blocks, the root in block 0 and a 3-block bitmap at the end.
+ * Asking for extents moves a version 1 image up to version 2; the original
+ * layout has no version to move, so it stays linked.
+ */
+static int cs1550_geometry_load(off_t size, long block_size, int extents)
+{
+	union
 	{
-		sscanf(path,"/%[^/]/%[^.].%s",directory,filename,extension);
-		printf("we're looking for / %s / %s . %s \n", directory, filename, extension);
-		int dir_loc = cs1550_find_dir_loc(directory);
-		printf("cs1550_find_dir_loc returned %d\n", dir_loc);
-		// directory does not exist
-		if(dir_loc<0)
-			return -ENOENT;
-		//Check if name is subdirectory
-		if(filename[0]=='\0')
+		cs1550_superblock sb;
+		char raw[MIN_BLOCK_SIZE];
+	} b0;
+	long i;
+
+	if(size < MIN_BLOCK_SIZE
+			|| pread(cs1550_disk_fd, &b0, MIN_BLOCK_SIZE, 0) != MIN_BLOCK_SIZE)
+		return -EIO;
+
+	if(b0.sb.nMagic == CS1550_MAGIC)
+	{
+		cs1550_superblock *sb = &b0.sb;
+
+		if(sb->nVersion < CS1550_VERSION_LINKED || sb->nVersion > CS1550_VERSION_EXTENTS
+				|| !cs1550_block_size_ok(sb->nBlockSize))
 		{
-			stbuf->st_mode  = S_IFDIR | 755;
-			stbuf->st_nlink = 2;
-			return 0;
+			printf("unsupported layout version %d, block size %ld\n",
+					sb->nVersion, sb->nBlockSize);
+			return -EINVAL;
 		}
-		else
+		if(sb->nBlocks > size / sb->nBlockSize || sb->nBitmapBlocks <= 0
+				|| sb->nBitmapStart <= sb->nRootBlock || sb->nRootBlock <= 0
+				|| sb->nBitmapStart + sb->nBitmapBlocks > sb->nBlocks)
 		{
-			//we're looking for a file in directory which is indexed at dir_loc
-			printf("looking for a file\n");
-		 	size_t fsize = 0;
-			int file_loc = cs1550_find_file_loc(dir_loc, filename, &fsize);
-			if(file_loc<0)
-				return -ENOENT;
-			printf("file loc is %d\n", file_loc);
-			stbuf->st_mode = S_IFREG | 0666;
-			stbuf->st_nlink = 1;
-			stbuf->st_size = fsize;
-			return 0;
+			printf("the superblock is damaged\n");
+			return -EINVAL;
 		}
-		res = -ENOENT;
+		if(extents && sb->nVersion < CS1550_VERSION_EXTENTS)
+		{
+			//older files keep their chains, only new ones get extents
+			sb->nVersion = CS1550_VERSION_EXTENTS;
+			if(pwrite(cs1550_disk_fd, sb, sizeof(*sb), 0) != sizeof(*sb))
+				return -EIO;
+			printf("moved the image up to version %d\n", sb->nVersion);
+		}
+		cs1550_extents = sb->nVersion >= CS1550_VERSION_EXTENTS;
+		cs1550_block_size = sb->nBlockSize;
+		cs1550_disk_blocks = sb->nBlocks;
+		cs1550_root_block = sb->nRootBlock;
+		cs1550_bitmap_block = sb->nBitmapStart;
+		cs1550_bitmap_blocks = sb->nBitmapBlocks;
+		return 0;
 	}
-	return res;
-}
-
-/* 
- * Called whenever the contents of a directory are desired. Could be from an 'ls'
- * or could even be when a user hits TAB to do autocompletion
- */
-static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-			 off_t offset, struct fuse_file_info *fi)
-{
-	//Since we're building with -Wall (all warnings reported) we need
-	//to "use" every parameter, so let's just cast them to void to
-	//satisfy the compiler
-	(void) offset;
-	(void) fi;
 
-	FILE * disk = fopen(".disk", "rb+");
-	cs1550_root_directory  root;
-	int read_ret = fread((void*) &root, sizeof(cs1550_root_directory), 1, disk);
-	if(read_ret<=0)
+	for(i = 0; i < MIN_BLOCK_SIZE && b0.raw[i] == 0; i++)
+		;
+	if(i == MIN_BLOCK_SIZE)
 	{
-		printf("error reading root directory\n");
-	    return -1;
-	}
-	fclose(disk);
+		int ret = cs1550_format(size, block_size, extents);
 
-	char directory[MAX_FILENAME*2];
-	char filename[MAX_FILENAME*2];
-	char extension[MAX_EXTENSION*2];
+		if(ret < 0)
+			return ret;
+		return cs1550_geometry_load(size, block_size, extents);
+	}
 
-	//set strings to empty
-	memset(directory,0,MAX_FILENAME+1);
-	memset(filename,0,MAX_FILENAME+1);
-	memset(extension,0,MAX_EXTENSION+1);
+	if(extents)
+		printf("the original layout can't hold extents, files stay linked\n");
+	cs1550_extents = 0;
+	cs1550_block_size = MIN_BLOCK_SIZE;
+	cs1550_disk_blocks = size / BLOCK_SIZE;
+	if(cs1550_disk_blocks < BITMAP_BLOCKS + 1)
+		return -EINVAL;
+	cs1550_root_block = 0;
+	cs1550_bitmap_block = cs1550_disk_blocks - BITMAP_BLOCKS;
+	cs1550_bitmap_blocks = BITMAP_BLOCKS;
+	return 0;
+}
 
-	sscanf(path,"/%[^/]/%[^.].%s",directory,filename,extension);
+//block_size is only used if the image has to be formatted; extents asks for
+//new files to be extent-mapped
+static int cs1550_disk_open(const char *name, unsigned long cache_kb, long block_size,
+		int extents)
+{
+	struct stat st;
 
-	if (strcmp(path, "/") == 0)
+	cs1550_disk_fd = open(name, O_RDWR);
+	if(cs1550_disk_fd < 0)
 	{
-	  	//the filler function allows us to add entries to the listing
-	  	//read the fuse.h file for a description (in the ../include dir)
-	  	filler(buf, ".", NULL, 0);
-	  	filler(buf, "..", NULL, 0);
-
-	  	int i;
-	  	for(i = 0; i<MAX_DIRS_IN_ROOT; i++)
-	  	{
-	  		if(root.directories[i].dname[0]!=0)
-	  		{
-	  			//this dir exists
-	  			printf("adding %s to readir\n", root.directories[i].dname);
-	  			filler(buf, root.directories[i].dname, NULL, 0);
-	  	    }
-	  	 }
-		return 0;
+		printf("error opening %s\n", name);
+		return -errno;
 	}
 
-	int dir_loc = cs1550_find_dir_loc(directory);
-	if(dir_loc<0)
+	if(fstat(cs1550_disk_fd, &st) < 0
+			|| cs1550_geometry_load(st.st_size, block_size, extents) < 0)
 	{
-		return -ENOENT;
+		printf("%s does not hold a usable file system\n", name);
+		close(cs1550_disk_fd);
+		cs1550_disk_fd = -1;
+		return -EINVAL;
 	}
-	filler(buf, ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
-	long dir_block = root.directories[dir_loc].nStartBlock;
 
-	disk = fopen(".disk", "rb");
-	cs1550_directory_entry dir_ent;
-	fseek(disk, BLOCK_SIZE*dir_block, SEEK_SET);
-	fread((void*)&dir_ent, sizeof(cs1550_directory_entry), 1, disk);
+	return cs1550_cache_init(cache_kb);
+}
 
-	int k;
-	for(k=0; k<MAX_FILES_IN_DIR; k++)
+static void cs1550_disk_close(void)
+{
+	if(cs1550_disk_fd >= 0)
 	{
-		if(dir_ent.files[k].fname[0]!=0)
-		{
-			printf("adding %s to readdir\n", dir_ent.files[k].fname);
-		    char file[MAX_FILENAME+MAX_EXTENSION+5];
-		    strcpy(file,dir_ent.files[k].fname);
-		    strcat(file, ".");
-		    strcat(file,dir_ent.files[k].fext);
-		    filler(buf, file, NULL, 0);
-		 }
-	}
-	fclose(disk);
-	return 0;
+		cs1550_cache_flush();
+		cs1550_cache_destroy();
+		fsync(cs1550_disk_fd);
+		close(cs1550_disk_fd);
+		cs1550_disk_fd = -1;
+	}
 }
 
-/* 
- * Creates a directory. We can ignore mode since we're not dealing with
- * permissions, as long as getattr returns appropriate ones for us.
- */
-static int cs1550_mkdir(const char *path, mode_t mode)
+static int cs1550_read_block(long block, void *buf)
 {
-	(void) path;
-	(void) mode;
+	cs1550_buf *b;
+
+	pthread_mutex_lock(&cs1550_cache_lock);
+	b = cs1550_cache_get(block, 1);
+	if(b != NULL)
+		memcpy(buf, b->data, BLOCK_SIZE);
+	pthread_mutex_unlock(&cs1550_cache_lock);
+	return b == NULL ? -EIO : 0;
+}
 
-	char directory[MAX_FILENAME *2];
-	char filename [MAX_FILENAME *2];
-	char extension[MAX_EXTENSION*2];
+static int cs1550_write_block(long block, const void *buf)
+{
+	cs1550_buf *b;
 
-	 //set strings to empty
-	 memset(directory,0,MAX_FILENAME*2);
-	 memset(filename,0,MAX_FILENAME*2);
-	 memset(extension,0,MAX_EXTENSION*2);
+	pthread_mutex_lock(&cs1550_cache_lock);
+	b = cs1550_cache_get(block, 0);
+	if(b != NULL)
+	{
+		memcpy(b->data, buf, BLOCK_SIZE);
+		b->dirty = 1;
+	}
+	pthread_mutex_unlock(&cs1550_cache_lock);
+	return b == NULL ? -EIO : 0;
+}
 
-	 printf("mkdir path: %s\n", path);
-	 sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
-	 if(directory == NULL)
-	 {
-		 printf("could not sscanf dir name, dir: %s\n", directory);
-		 return -1;
-	 }
-	 printf("checking length of %s \n", directory);
+//the buffer holding block once nobody is reading it in, or NULL if it is
+//not cached. Called and returns with cs1550_cache_lock held.
+static cs1550_buf *cs1550_cache_peek(long block)
+{
+	cs1550_buf *b;
 
-	 if(strlen(directory)>8||strlen(directory)<=0)
-	 {
-		 //fclose(disk);
-		 printf("name too long (or short)\n");
-		 return -ENAMETOOLONG;
-	 }
+	while((b = cs1550_cache_lookup(block)) != NULL && b->busy)
+		pthread_cond_wait(&cs1550_cache_io_done, &cs1550_cache_lock);
+	return b;
+}
 
-	 printf("good length for directory name\n");
-	 int loc = cs1550_find_dir_loc(directory);
-	 if(loc>=0)
-	 {
-		 //it already exists
-		 //fclose(disk);
-		 printf("dir exists\n");
-		 return -EEXIST;
-	 }
+//throw away any cached copies of the n blocks from block, dirty or not,
+//because they now belong to a file that is written to .disk directly
+static void cs1550_cache_discard(long block, long n)
+{
+	cs1550_buf *b;
+	long i;
 
-	 printf("does not already exist\n");
+	pthread_mutex_lock(&cs1550_cache_lock);
+	for(i = 0; i < n; i++)
+	{
+		b = cs1550_cache_peek(block + i);
+		if(b != NULL)
+			cs1550_cache_drop(b);
+	}
+	pthread_mutex_unlock(&cs1550_cache_lock);
+}
 
-	 FILE * disk = fopen(".disk", "rb+");
-	 cs1550_root_directory  root;
-	 int read_ret = fread((void*) &root, sizeof(cs1550_root_directory), 1, disk);
+#if FUSE_VERSION >= 29
 
-	 if(read_ret<=0)
-	 {
-		 printf("error reading root directory\n");
-		 return -1;
-	 }
+//write back any dirty cached copies of blocks, so that .disk itself can be
+//handed to FUSE to read them from
+static int cs1550_cache_sync(const long *blocks, long n)
+{
+	cs1550_buf *b;
+	long i;
+	int ret = 0;
 
-	 if(root.nDirectories >=MAX_DIRS_IN_ROOT)
-	 {
-		 printf("too many dirs\n");
-		 fclose(disk);
-		 return -EPERM;
-	 }
+	pthread_mutex_lock(&cs1550_cache_lock);
+	for(i = 0; i < n; i++)
+	{
+		b = cs1550_cache_peek(blocks[i]);
+		if(b != NULL && cs1550_buf_writeback(b) < 0)
+			ret = -EIO;
+	}
+	pthread_mutex_unlock(&cs1550_cache_lock);
+	return ret;
+}
 
-	 fclose(disk);
-	 int block_loc = -2;
-	 int i;
-	 for(i=0; i<MAX_DIRS_IN_ROOT; i++)
-	 {
-		 if(root.directories[i].dname[0]==0)
-		 {
-			 //empty dir
-			 strcpy(root.directories[i].dname,directory);
-		     block_loc = cs1550_find_free_block();
-		     printf("block loc = %d\n", block_loc);
-		     root.directories[i].nStartBlock = block_loc;
-		     break;
-		 }
+//forget a clean cached copy of block after it was written to .disk directly
+static void cs1550_cache_forget(long block)
+{
+	cs1550_buf *b;
 
-	 }
+	pthread_mutex_lock(&cs1550_cache_lock);
+	b = cs1550_cache_peek(block);
+	if(b != NULL && !b->dirty)
+		cs1550_cache_drop(b);
+	pthread_mutex_unlock(&cs1550_cache_lock);
+}
 
-	 disk = fopen(".disk", "rb+");
-	 cs1550_directory_entry new_dir;
-	 new_dir.nFiles = 0;
-	 fseek(disk, BLOCK_SIZE * root.directories[i].nStartBlock , SEEK_SET);
-	 fwrite((void*)&root, sizeof(cs1550_directory_entry), 1, disk);
+#endif /* FUSE_VERSION >= 29 */
 
-	 rewind(disk);
-	 fwrite((void*)&root, sizeof(cs1550_root_directory), 1, disk);
-	 fclose(disk);
-	 printf("wrote to root dir and closed .disk\n");
+/*
+ * Readahead. Reads that look sequential hand the next blocks of their chain
+ * to a background thread, which claims cache buffers for whichever of them
+ * are missing and fills each physically contiguous stretch with a single
+ * preadv. Where the reader does not know the chain that far yet, the thread
+ * is given the last known block instead and follows the links itself.
+ */
 
-	 return 0;
-}
+//default readahead ceiling, overridden with -o readahead_kb=N (0 turns it off)
+#define	RA_DEFAULT_KB 256
 
-/* 
- * Removes a directory.
- */
-static int cs1550_rmdir(const char *path)
-{
-	(void) path;
-    return 0;
-}
+//largest readahead window, in blocks
+static long cs1550_ra_max = 0;
 
-/* 
- * Does the actual creation of a file. Mode and dev can be ignored.
- *
- */
-static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
-{
-	(void) mode;
-	(void) dev;
+//the thread only serves reads that copy out of the cache. The low-level
+//build on FUSE 2.9 splices every read from .disk and asks the kernel to
+//read ahead instead
+#if !defined(CS1550_LOWLEVEL) || FUSE_VERSION < 29
+#define	CS1550_RA_THREAD
+#endif
 
-	printf("mknod\n");
+#ifdef CS1550_RA_THREAD
 
-	char directory[MAX_FILENAME *2];
-	char filename [MAX_FILENAME *2];
-	char extension[MAX_EXTENSION*2];
+//requests that can be waiting for the thread, and blocks read at a time
+#define	RA_QUEUE 1024
+#define	RA_BATCH 64
 
-	//set strings to empty
-	memset(directory, 0,MAX_FILENAME  * 2);
-	memset(filename,  0,MAX_FILENAME  * 2);
-	memset(extension, 0,MAX_EXTENSION * 2);
+struct cs1550_ra_req
+{
+	long block;		//block to fetch, or to follow the chain from
+	long follow;	//blocks of the chain after block to fetch, 0 for just block
+};
 
-	sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
-	printf("mknod dir: / %s / %s . %s\n", directory, filename, extension);
+static struct cs1550_ra_req cs1550_ra_queue[RA_QUEUE];
+static long cs1550_ra_head = 0;		//next request to hand out
+static long cs1550_ra_count = 0;	//requests waiting
 
-	if(filename[0]=='\0'){
-		printf("can't create in the root dir\n");
-		return -EPERM;
-	}
+static pthread_mutex_t cs1550_ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cs1550_ra_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t cs1550_ra_thread;
+static int cs1550_ra_running = 0;
 
-	if(strlen(filename)>MAX_FILENAME){
-		printf("%s is too long\n", filename);
-		return -ENAMETOOLONG;
-	}
-	if(strlen(extension)>MAX_EXTENSION){
-		printf("%s is too long\n", extension);
-		return -ENAMETOOLONG;
-	}
-	int loc = cs1550_find_dir_loc(directory);
-	if(loc<0){
-		printf("didn't find dir\n");
-		return -EPERM;
-	}
+//queue blocks for prefetching; whatever does not fit is dropped
+static void cs1550_prefetch(const long *blocks, long n)
+{
+	long i;
 
-	int file_loc = cs1550_find_file_loc(loc, filename, NULL);
-	if(file_loc>=0){
-		printf("find file\n");
-		return -EEXIST;
-	}
+	if(!cs1550_ra_running)
+		return;
 
-	FILE * disk;
-	disk = fopen(".disk", "rb+");
+	pthread_mutex_lock(&cs1550_ra_lock);
+	for(i = 0; i < n && cs1550_ra_count < RA_QUEUE; i++)
+	{
+		struct cs1550_ra_req *r = &cs1550_ra_queue[(cs1550_ra_head + cs1550_ra_count) % RA_QUEUE];
 
-	cs1550_root_directory  root;
-	int read_ret = fread((void*) &root, sizeof(cs1550_root_directory), 1, disk);
-	if(read_ret<=0){
-		printf("error reading root directory\n");
-		return -1;
+		r->block = blocks[i];
+		r->follow = 0;
+		cs1550_ra_count++;
 	}
+	pthread_cond_signal(&cs1550_ra_wake);
+	pthread_mutex_unlock(&cs1550_ra_lock);
+}
 
-	cs1550_directory_entry dir;
+//queue the n blocks of a chain that come after block
+static void cs1550_prefetch_chain(long block, long n)
+{
+	if(!cs1550_ra_running || n <= 0)
+		return;
 
-	long dir_block = root.directories[loc].nStartBlock;
+	pthread_mutex_lock(&cs1550_ra_lock);
+	if(cs1550_ra_count < RA_QUEUE)
+	{
+		struct cs1550_ra_req *r = &cs1550_ra_queue[(cs1550_ra_head + cs1550_ra_count) % RA_QUEUE];
 
-	fseek(disk, BLOCK_SIZE*dir_block, SEEK_SET); //seek to dir_block
+		r->block = block;
+		r->follow = n;
+		cs1550_ra_count++;
+	}
+	pthread_cond_signal(&cs1550_ra_wake);
+	pthread_mutex_unlock(&cs1550_ra_lock);
+}
 
-	read_ret = fread((void*) &dir, sizeof(cs1550_root_directory), 1, disk);
+//bring blocks that are not cached yet into the cache
+static void cs1550_cache_fill(const long *blocks, long n)
+{
+	cs1550_buf *bufs[RA_BATCH];
+	int ok[RA_BATCH];
+	struct iovec iov[RA_BATCH];
+	long i, j, k, m = 0;
 
-	fclose(disk);
+	pthread_mutex_lock(&cs1550_cache_lock);
+	for(i = 0; i < n && m < RA_BATCH; i++)
+	{
+		cs1550_buf *b;
 
-	if(dir.nFiles >= MAX_FILES_IN_DIR){
-		printf("too many files in this dir\n");
-		return -EPERM;
+		if(blocks[i] <= 0 || blocks[i] >= cs1550_disk_blocks)
+			continue;
+		if(cs1550_cache_lookup(blocks[i]) != NULL)
+			continue;
+		b = cs1550_cache_claim(blocks[i]);
+		if(b == NULL)
+			break;
+		b->busy = 1;
+		cs1550_lru_unlink(b);
+		cs1550_lru_push(b);
+		bufs[m++] = b;
 	}
+	pthread_mutex_unlock(&cs1550_cache_lock);
 
-	dir.nFiles++;
+	for(i = 0; i < m; i = j)
+	{
+		ssize_t ret;
 
-	printf("looking up files\n");
-	int i;
-	long block_loc=-1;
-	for(i=0; i<MAX_FILES_IN_DIR; i++){
-		if( dir.files[i].fname[0]=='\0'){ //empty spot
-			printf("found an empty spot at %d\n", i);
-		    strcpy(dir.files[i].fname, filename );
-		    strcpy(dir.files[i].fext , extension);
-		    dir.files[i].fsize = 0;
-		    block_loc = cs1550_find_free_block();
-		    dir.files[i].nStartBlock = block_loc;
-		    break;
+		for(j = i; j < m && bufs[j]->block == bufs[i]->block + (j - i); j++)
+		{
+			iov[j - i].iov_base = bufs[j]->data;
+			iov[j - i].iov_len = BLOCK_SIZE;
 		}
+		ret = preadv(cs1550_disk_fd, iov, j - i, (off_t) bufs[i]->block * BLOCK_SIZE);
+		for(k = i; k < j; k++)
+			ok[k] = ret == (ssize_t) ((j - i) * BLOCK_SIZE);
 	}
 
-	if(block_loc == -1){
-		printf("error\n");
-		return -1;
+	pthread_mutex_lock(&cs1550_cache_lock);
+	for(i = 0; i < m; i++)
+	{
+		if(ok[i])
+			bufs[i]->busy = 0;
+		else
+			cs1550_cache_drop(bufs[i]);
 	}
-
-	cs1550_disk_block file_block;
-	file_block.nNextBlock = -1;
-
-	//write to disk
-	disk = fopen(".disk", "rb+");
-	fseek(disk, BLOCK_SIZE*dir_block, SEEK_SET);
-	fwrite((void*) &dir, sizeof(cs1550_root_directory), 1, disk);
-
-	fseek(disk, BLOCK_SIZE*block_loc,SEEK_SET);
-	fwrite((void*)&file_block, sizeof(cs1550_disk_block), 1, disk);
-
-	fclose(disk);
-
-	return 0;
+	pthread_cond_broadcast(&cs1550_cache_io_done);
+	pthread_mutex_unlock(&cs1550_cache_lock);
 }
 
 /*
- * Deletes a file
+ * Prefetch up to n blocks of the chain after block. The next link is only
+ * known once a block has been read, so each stretch is guessed to be
+ * contiguous, read in one go, and then checked link by link; the walk picks
+ * up again from the last block the guess got right.
  */
-static int cs1550_unlink(const char *path)
+static void cs1550_ra_follow(long block, long n)
 {
-    (void) path;
+	long run[RA_BATCH];
+	cs1550_disk_block *file = cs1550_block_alloc();
+	long i, k;
 
-    return 0;
-}
+	if(file == NULL)
+		return;
+	while(n > 0)
+	{
+		if(cs1550_read_block(block, file) < 0 || file->nNextBlock <= 0)
+			break;
 
-/* 
- * Read size bytes from file into buf starting from offset
- *
- */
-static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
-			  struct fuse_file_info *fi)
-{
-	(void) buf;
-	(void) offset;
-	(void) fi;
-	(void) path;
+		k = n < RA_BATCH ? n : RA_BATCH;
+		for(i = 0; i < k; i++)
+			run[i] = file->nNextBlock + i;
+		cs1550_cache_fill(run, k);
 
-	if(size<=0){
-		printf("size = %d",size);
-		return -1;
+		block = file->nNextBlock;
+		n--;
+		for(i = 1; i < k; i++)
+		{
+			if(cs1550_read_block(block, file) < 0)
+			{
+				n = 0;
+				break;
+			}
+			if(file->nNextBlock != block + 1)
+				break;
+			block++;
+			n--;
+		}
 	}
+	free(file);
+}
 
-	char directory[MAX_FILENAME *2];
-	char filename [MAX_FILENAME *2];
-	char extension[MAX_EXTENSION*2];
+static void *cs1550_ra_worker(void *arg)
+{
+	long batch[RA_BATCH];
+	struct cs1550_ra_req r;
+	long n;
 
-	//set strings to empty
-	memset(directory, 0,MAX_FILENAME  * 2);
-	memset(filename,  0,MAX_FILENAME  * 2);
-	memset(extension, 0,MAX_EXTENSION * 2);
-	sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
+	(void) arg;
 
-	printf("cs1550 read from / %s / %s . %s\n", directory, filename, extension);
+	pthread_mutex_lock(&cs1550_ra_lock);
+	while(cs1550_ra_running)
+	{
+		if(cs1550_ra_count == 0)
+		{
+			pthread_cond_wait(&cs1550_ra_wake, &cs1550_ra_lock);
+			continue;
+		}
 
+		//gather plain blocks up to the first chain to follow
+		r.follow = 0;
+		for(n = 0; n < RA_BATCH && cs1550_ra_count > 0 && r.follow == 0; )
+		{
+			r = cs1550_ra_queue[cs1550_ra_head];
+			cs1550_ra_head = (cs1550_ra_head + 1) % RA_QUEUE;
+			cs1550_ra_count--;
+			if(r.follow == 0)
+				batch[n++] = r.block;
+		}
 
-	int dir_loc = cs1550_find_dir_loc(directory);
-	if(dir_loc<0){
-		printf("dir not found\n");
-		return -ENOENT;
+		pthread_mutex_unlock(&cs1550_ra_lock);
+		if(n > 0)
+			cs1550_cache_fill(batch, n);
+		if(r.follow > 0)
+			cs1550_ra_follow(r.block, r.follow);
+		pthread_mutex_lock(&cs1550_ra_lock);
 	}
-	int file_loc = cs1550_find_file_loc(dir_loc, filename, NULL);
-	if(file_loc<0){
-		printf("file not found\n");
-		return -ENOENT;
-	}
-
+	pthread_mutex_unlock(&cs1550_ra_lock);
+	return NULL;
+}
 
-	printf("opening disk\n");
-	FILE * disk;
-	disk = fopen(".disk", "rb+");
-	if(disk==NULL){
-		printf("problem opening the disk\n");
-		return -1;
-	}
-	printf("reading root\n");
-	cs1550_root_directory root;
-	int read_ret = fread((void*)&root, sizeof(cs1550_root_directory), 1, disk);
-	if(read_ret<0){
-		printf("problem reading the root\n");
-		return -1;
-	}
-	long dir_block = root.directories[dir_loc].nStartBlock;
+#endif /* CS1550_RA_THREAD */
 
-	printf("reading dir\n");
-	cs1550_directory_entry dir;
-	fseek(disk, dir_block*BLOCK_SIZE, SEEK_SET);
-	read_ret = fread((void*)&dir, sizeof(cs1550_directory_entry), 1, disk);
-	if(read_ret<0){
-		printf("problem reading the dir\n");
-		return -1;
-	}
-	if (read_ret>0)
+static void cs1550_ra_start(unsigned long kb)
+{
+	cs1550_ra_max = (long) (kb * 1024 / BLOCK_SIZE);
+#ifdef CS1550_RA_THREAD
+	if(cs1550_ra_max == 0)
+		return;
+
+	cs1550_ra_head = cs1550_ra_count = 0;
+	cs1550_ra_running = 1;
+	if(pthread_create(&cs1550_ra_thread, NULL, cs1550_ra_worker, NULL) != 0)
 	{
-		return -EISDIR;
+		printf("could not start the readahead thread\n");
+		cs1550_ra_running = 0;
 	}
+#endif
+}
 
-	printf("finding file_block\n");
-	long file_block = dir.files[file_loc].nStartBlock;
+static void cs1550_ra_stop(void)
+{
+#ifdef CS1550_RA_THREAD
+	if(!cs1550_ra_running)
+		return;
+
+	pthread_mutex_lock(&cs1550_ra_lock);
+	cs1550_ra_running = 0;
+	pthread_cond_signal(&cs1550_ra_wake);
+	pthread_mutex_unlock(&cs1550_ra_lock);
+	pthread_join(cs1550_ra_thread, NULL);
+#endif
+}
 
+/*
+ * Free block bitmap. The whole bitmap is kept in memory as 64-bit words from
+ * mount to unmount, and only the bitmap blocks whose bits changed are copied
+ * back into the buffer cache. Allocation does not scan it; it goes through
+ * the index of free runs below.
+ */
 
-	size_t fsize = dir.files[file_loc].fsize;
-	if(offset>fsize){
-		printf("offset is bigger than filesize\n");
-		return -EFBIG;
-	}
+static uint64_t *cs1550_bitmap = NULL;
 
-	if(file_block<=0){
-		printf("problem with the file_block\n");
-		return -1;
-	}
+//number of allocatable blocks (1 .. bitmap start - 1) and words covering them
+static long cs1550_bitmap_bits = 0;
+static long cs1550_bitmap_words = 0;
 
-	int offset_blocks = offset/MAX_DATA_IN_BLOCK;
-	printf("calculated number of blocks in the offset as %d\n", offset_blocks);
+//which bitmap blocks differ from what the cache holds, and the range of
+//them worth looking at
+static char *cs1550_bitmap_dirty = NULL;
+static long cs1550_bitmap_dirty_lo = 0;
+static long cs1550_bitmap_dirty_hi = 0;
 
-	cs1550_disk_block file;
-	fseek(disk, file_block*BLOCK_SIZE, SEEK_SET);
-	read_ret = fread((void*)&file, sizeof(cs1550_disk_block), 1, disk);
-	if(read_ret<0){
-		printf("problem reading disk block\n");
-		return -1;
+static int cs1550_bitmap_load(void)
+{
+	free(cs1550_bitmap);
+	free(cs1550_bitmap_dirty);
+	cs1550_bitmap = malloc(cs1550_bitmap_blocks * BLOCK_SIZE);
+	cs1550_bitmap_dirty = calloc(cs1550_bitmap_blocks, 1);
+	if(cs1550_bitmap == NULL || cs1550_bitmap_dirty == NULL)
+		return -ENOMEM;
+
+	//nothing has gone through the cache yet, so read it all in one go
+	if(cs1550_dev_read(cs1550_bitmap_start(), cs1550_bitmap_blocks,
+			cs1550_bitmap) < 0)
+	{
+		printf("error reading the bitmap\n");
+		return -EIO;
 	}
+	cs1550_bitmap_dirty_lo = cs1550_bitmap_dirty_hi = 0;
 
-	printf("seeking past the offset blocks\n");
-	int i;
-	for(i=0; i<offset_blocks; i++){
-		printf("i = %d\n",i);
-		file_block = file.nNextBlock;
-		if(file_block<=0){
-			printf("problem with the file block number\n");
-		    return -1;
-		}
+	cs1550_bitmap_bits = cs1550_bitmap_start() - 1;
+	if(cs1550_bitmap_bits > cs1550_bitmap_blocks * BLOCK_SIZE * 8)
+		cs1550_bitmap_bits = cs1550_bitmap_blocks * BLOCK_SIZE * 8;
+	cs1550_bitmap_words = (cs1550_bitmap_bits + 63) / 64;
+	return 0;
+}
 
-		fseek(disk, file_block*BLOCK_SIZE, SEEK_SET);
-	    read_ret = fread((void*)&file, sizeof(cs1550_disk_block), 1, disk);
-	    	if(read_ret<0){
-	    		printf("problem reading disk block\n");
-	            return -1;
-	         }
-		}
-		printf("seeked\n");
+static void cs1550_bitmap_set(long bit, int used)
+{
+	long i = bit / 8 / BLOCK_SIZE;
 
+	if(used)
+		cs1550_bitmap[bit / 64] |= (uint64_t) 1 << (bit % 64);
+	else
+		cs1550_bitmap[bit / 64] &= ~((uint64_t) 1 << (bit % 64));
+	if(cs1550_bitmap_dirty_lo == cs1550_bitmap_dirty_hi)
+	{
+		cs1550_bitmap_dirty_lo = i;
+		cs1550_bitmap_dirty_hi = i + 1;
+	}
+	else if(i < cs1550_bitmap_dirty_lo)
+		cs1550_bitmap_dirty_lo = i;
+	else if(i >= cs1550_bitmap_dirty_hi)
+		cs1550_bitmap_dirty_hi = i + 1;
+	cs1550_bitmap_dirty[i] = 1;
+}
 
-		int byte_in_block = offset % MAX_DATA_IN_BLOCK;
+//copy the changed bitmap blocks into the buffer cache
+static int cs1550_bitmap_sync(void)
+{
+	long i;
 
-		int count;
-		for(count = 0; count <size; count++ ){
-			if((count+byte_in_block)%MAX_DATA_IN_BLOCK==0&&count!=0){
-		    //next block
-				long next_block = file.nNextBlock;
-				fseek(disk, next_block*BLOCK_SIZE, SEEK_SET);
-				fread((void*)&file,sizeof(cs1550_disk_block),1,disk);
-			}
-			if(count+offset>fsize){
-				break;
-			}
-			buf[count] = file.data[(count+byte_in_block)%MAX_DATA_IN_BLOCK];
-			printf("read %c from %d\n", file.data[(count+byte_in_block)%MAX_DATA_IN_BLOCK], (count+byte_in_block)%MAX_DATA_IN_BLOCK);
+	for(i = cs1550_bitmap_dirty_lo; i < cs1550_bitmap_dirty_hi; i++)
+	{
+		if(!cs1550_bitmap_dirty[i])
+			continue;
+		if(cs1550_write_block(cs1550_bitmap_start() + i,
+				(char *) cs1550_bitmap + i * BLOCK_SIZE) < 0)
+		{
+			cs1550_bitmap_dirty_lo = i;
+			return -EIO;
 		}
+		cs1550_bitmap_dirty[i] = 0;
+	}
+	cs1550_bitmap_dirty_lo = cs1550_bitmap_dirty_hi = 0;
+	return 0;
+}
+
+static void cs1550_bitmap_free(void)
+{
+	free(cs1550_bitmap);
+	free(cs1550_bitmap_dirty);
+	cs1550_bitmap = NULL;
+	cs1550_bitmap_dirty = NULL;
+}
 
-		fclose(disk);
-		return count;
+//free bits of word w, ignoring the bits past the last allocatable block
+static uint64_t cs1550_bitmap_free_bits(long w)
+{
+	uint64_t bits = ~cs1550_bitmap[w];
 
+	if(w == cs1550_bitmap_words - 1 && cs1550_bitmap_bits % 64 != 0)
+		bits &= ((uint64_t) 1 << (cs1550_bitmap_bits % 64)) - 1;
+	return bits;
 }
 
-/* 
- * Write size bytes from buf into file starting from offset
- *
+/*
+ * In-memory copy of every data block's nNextBlock, FAT style. Entries start
+ * out unknown and are filled in as data blocks pass through
+ * cs1550_read_data_block and cs1550_write_data_block, so once a chain has
+ * been walked it can be followed again without touching a single block.
  */
-static int cs1550_write(const char *path, const char *buf, size_t size, 
-			  off_t offset, struct fuse_file_info *fi)
+
+#define	FAT_UNKNOWN (-2)
+
+static long *cs1550_fat = NULL;
+
+static int cs1550_fat_init(void)
 {
-	(void) buf;
-	(void) offset;
-	(void) fi;
-	(void) path;
+	long i;
 
-	if(size<=0){
-		  printf("size = %d",size);
-		  return -1;
-		}
+	free(cs1550_fat);
+	cs1550_fat = malloc(cs1550_disk_blocks * sizeof(long));
+	if(cs1550_fat == NULL)
+		return -ENOMEM;
+	for(i = 0; i < cs1550_disk_blocks; i++)
+		cs1550_fat[i] = FAT_UNKNOWN;
+	return 0;
+}
 
-		char directory[MAX_FILENAME *2];
-	        char filename [MAX_FILENAME *2];
-	        char extension[MAX_EXTENSION*2];
+static void cs1550_fat_free(void)
+{
+	free(cs1550_fat);
+	cs1550_fat = NULL;
+}
 
-	        //set strings to empty
-	        memset(directory, 0,MAX_FILENAME  * 2);
-	        memset(filename,  0,MAX_FILENAME  * 2);
-	        memset(extension, 0,MAX_EXTENSION * 2);
+static int cs1550_read_data_block(long block, cs1550_disk_block *file)
+{
+	if(cs1550_read_block(block, file) < 0)
+		return -EIO;
+	cs1550_fat[block] = file->nNextBlock > 0 ? file->nNextBlock : -1;
+	return 0;
+}
 
-		sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
-		printf("cs1550_write with path / %s / %s . %s\n",directory,filename,extension);
+static int cs1550_write_data_block(long block, const cs1550_disk_block *file)
+{
+	if(block <= 0 || block >= cs1550_disk_blocks)
+		return -EIO;
+	cs1550_fat[block] = file->nNextBlock > 0 ? file->nNextBlock : -1;
+	return cs1550_write_block(block, file);
+}
 
-		int dir_loc = cs1550_find_dir_loc(directory);
-		if(dir_loc<0){
-		  printf("dir not found\n");
-		  return -ENOENT;
-		}
-		int file_loc = cs1550_find_file_loc(dir_loc, filename, NULL);
-		if(file_loc<0){
-		  printf("file not found\n");
-		  return -ENOENT;
-		}
-		printf("opening disk\n");
-		FILE * disk;
-		disk = fopen(".disk", "rb+");
-		if(disk==NULL){
-		  printf("problem opening the disk\n");
-		  return -1;
-		}
-		printf("reading root\n");
-		cs1550_root_directory root;
-		int read_ret = fread((void*)&root, sizeof(cs1550_root_directory), 1, disk);
-		if(read_ret<0){
-		  printf("problem reading the root\n");
-		  return -1;
-		}
-		long dir_block = root.directories[dir_loc].nStartBlock;
-
-		printf("reading dir\n");
-		cs1550_directory_entry dir;
-		fseek(disk, dir_block*BLOCK_SIZE, SEEK_SET);
-		read_ret = fread((void*)&dir, sizeof(cs1550_directory_entry), 1, disk);
-		if(read_ret<0){
-		  printf("problem reading the dir\n");
-		  return -1;
-		}
+//the block after block in its chain, -1 at the end of the chain
+static long cs1550_fat_next(long block)
+{
+	if(block <= 0 || block >= cs1550_disk_blocks)
+		return -1;
+	if(cs1550_fat[block] == FAT_UNKNOWN)
+	{
+		cs1550_disk_block *file = cs1550_block_alloc();
+		int ret = file != NULL ? cs1550_read_data_block(block, file) : -ENOMEM;
 
-		printf("finding file_block\n");
-		long file_block = dir.files[file_loc].nStartBlock;
-		if(offset>dir.files[file_loc].fsize){
-		  printf("offset is bigger than filesize\n");
-		  return -EFBIG;
-		}
-		dir.files[file_loc].fsize = offset + size;
-		if(file_block<=0){
-		  printf("problem with the file_block\n");
-		  return -1;
-		}
+		free(file);
+		if(ret < 0)
+			return -1;
+	}
+	return cs1550_fat[block];
+}
 
-		int offset_blocks = offset/MAX_DATA_IN_BLOCK;
-		printf("calculated num of blocks in the offset as %d\n", offset_blocks);
+//first bit at or after bit whose state is used (1) or free (0), or
+//cs1550_bitmap_bits if there is none
+static long cs1550_bitmap_next(long bit, int used)
+{
+	long w = bit / 64;
+	uint64_t bits;
 
-		cs1550_disk_block file;
-		fseek(disk, file_block*BLOCK_SIZE, SEEK_SET);
-		read_ret = fread((void*)&file, sizeof(cs1550_disk_block), 1, disk);
-		if(read_ret<0){
-		  printf("problem reading disk block\n");
-		  return -1;
-		}
+	if(bit >= cs1550_bitmap_bits)
+		return cs1550_bitmap_bits;
 
-		printf("seeking past the offset blocks\n");
-		int i;
-		for(i=0; i<offset_blocks; i++){//get to where we're going
-		  printf("i = %d\n",i);
-		  file_block = file.nNextBlock;
-		  if(file_block<=0){
-		    printf("problem with the file block number\n");
-		    return -1;
-		  }
-
-		  fseek(disk, file_block*BLOCK_SIZE, SEEK_SET);
-	          read_ret = fread((void*)&file, sizeof(cs1550_disk_block), 1, disk);
-	          if(read_ret<0){
-	            printf("problem reading disk block\n");
-	            return -1;
-	          }
-		}
-		printf("seeked\n");
-
-		int cont = 0;
-		int byte_in_block = offset % MAX_DATA_IN_BLOCK;
-		for(i = 0; i<size; i){
-		  while((i+byte_in_block)%MAX_DATA_IN_BLOCK!=0||i==0||cont==1){
-		    cont = 0;
-		    file.data[(i+byte_in_block)%MAX_DATA_IN_BLOCK]=buf[i];
-		    printf("wrote %c,%c to %d\n", buf[i],file.data[(i+byte_in_block)%MAX_DATA_IN_BLOCK], (i+byte_in_block)%MAX_DATA_IN_BLOCK);
-		    i++;
-		    if(i>size)
-		      break;
-		  }
-		  fclose(disk);
-		  if(file.nNextBlock>0){ //we're overwriting stuff, it'd be easier to just get new blocks
-		    cs1550_mark_blocks_free(file.nNextBlock);
-		  }
-		  file.nNextBlock = cs1550_find_free_block();
-		  disk = fopen(".disk", "rb+");
-		  fseek(disk, file_block*BLOCK_SIZE, SEEK_SET);
-		  fwrite((void*)&file, sizeof(cs1550_disk_block),1,disk);
-		  if(i>size)
-		    break;
-		  file_block = file.nNextBlock;
-		  fseek(disk, file_block*BLOCK_SIZE, SEEK_SET);
-		  fread((void*)&file, sizeof(cs1550_disk_block),1,disk);
-		  cont = 1;
-		}
-		dir.files[file_loc].fsize = offset+size;
-		fseek(disk, dir_block*BLOCK_SIZE, SEEK_SET);
-		fwrite((void*)&dir, sizeof(cs1550_directory_entry),1,disk);
-		fclose(disk);
+	bits = used ? cs1550_bitmap[w] : cs1550_bitmap_free_bits(w);
+	bits &= ~(uint64_t) 0 << (bit % 64);
+	while(bits == 0)
+	{
+		if(++w >= cs1550_bitmap_words)
+			return cs1550_bitmap_bits;
+		bits = used ? cs1550_bitmap[w] : cs1550_bitmap_free_bits(w);
+	}
 
-		return size;
+	bit = w * 64 + __builtin_ctzll(bits);
+	return bit < cs1550_bitmap_bits ? bit : cs1550_bitmap_bits;
 }
 
-/******************************************************************************
- *
- *  DO NOT MODIFY ANYTHING BELOW THIS LINE
- *
- *****************************************************************************/
-
 /*
- * truncate is called when a new file is created (with a 0 size) or when an
- * existing file is made shorter. We're not handling deleting files or 
- * truncating existing ones, so all we need to do here is to initialize
- * the appropriate directory entry.
- *
+ * Free space index. Every run of free bits in the bitmap is a hole, kept in
+ * a treap ordered by length and then position, so the smallest hole that
+ * fits a request and the largest one are both found in logarithmic time.
+ * Each hole is also hashed by its first bit and by its last, which lets a
+ * freed run merge with the holes on either side of it without a search and
+ * keeps the index in proportion to the holes rather than the disk. The index
+ * is built from the bitmap at mount and, like the bitmap, belongs to
+ * whoever holds cs1550_alloc_lock.
  */
-static int cs1550_truncate(const char *path, off_t size)
+
+struct cs1550_hole
 {
-	(void) path;
-	(void) size;
+	long start;						//first free bit
+	long len;						//free bits in the run
+	uint64_t prio;					//treap priority, a hash of start
+	struct cs1550_hole *left;		//shorter holes, or as long and further down
+	struct cs1550_hole *right;		//longer holes, or as long and further up
+	struct cs1550_hole *start_next;	//next hole in the same bucket by start
+	struct cs1550_hole *end_next;	//and by last bit
+};
 
-    return 0;
-}
+#define	HOLE_HASH_BUCKETS 64
 
+//holes are carved out of chunks of this many, which stay until unmount
+#define	HOLE_CHUNK 1024
 
-/* 
- * Called when we open a file
- *
- */
-static int cs1550_open(const char *path, struct fuse_file_info *fi)
+struct cs1550_hole_chunk
 {
-	(void) path;
-	(void) fi;
-    /*
-        //if we can't find the desired file, return an error
-        return -ENOENT;
-    */
+	struct cs1550_hole_chunk *next;
+	struct cs1550_hole holes[HOLE_CHUNK];
+};
 
-    //It's not really necessary for this project to anything in open
+static struct cs1550_hole *cs1550_holes = NULL;		//root of the treap
+static struct cs1550_hole_chunk *cs1550_hole_chunks = NULL;
+static struct cs1550_hole *cs1550_hole_spare = NULL;	//unused ones, by right
+static struct cs1550_hole **cs1550_hole_by_start = NULL;	//buckets, a power of two
+static struct cs1550_hole **cs1550_hole_by_end = NULL;		//as many again
+static unsigned long cs1550_hole_mask = 0;					//buckets - 1
+static long cs1550_hole_count = 0;							//holes indexed
 
-    /* We're not going to worry about permissions for this project, but 
-	   if we were and we don't have them to the file we should return an error
+static unsigned long cs1550_hole_hash(long bit)
+{
+	return (unsigned long) (((uint64_t) bit * 0x9e3779b97f4a7c15ULL) >> 32) & cs1550_hole_mask;
+}
 
-        return -EACCES;
-    */
+//put h in the buckets for its first and last bit
+static void cs1550_hole_link(struct cs1550_hole *h)
+{
+	unsigned long b = cs1550_hole_hash(h->start);
 
-    return 0; //success!
+	h->start_next = cs1550_hole_by_start[b];
+	cs1550_hole_by_start[b] = h;
+	b = cs1550_hole_hash(h->start + h->len - 1);
+	h->end_next = cs1550_hole_by_end[b];
+	cs1550_hole_by_end[b] = h;
 }
 
-/*
- * Called when close is called on a file descriptor, but because it might
- * have been dup'ed, this isn't a guarantee we won't ever need the file 
- * again. For us, return success simply to avoid the unimplemented error
- * in the debug log.
- */
-static int cs1550_flush (const char *path , struct fuse_file_info *fi)
+static void cs1550_hole_unlink(struct cs1550_hole *h)
 {
-	(void) path;
-	(void) fi;
-
-	return 0; //success!
+	struct cs1550_hole **p = &cs1550_hole_by_start[cs1550_hole_hash(h->start)];
+
+	while(*p != h)
+		p = &(*p)->start_next;
+	*p = h->start_next;
+	p = &cs1550_hole_by_end[cs1550_hole_hash(h->start + h->len - 1)];
+	while(*p != h)
+		p = &(*p)->end_next;
+	*p = h->end_next;
 }
 
+//the hole whose first bit is bit, NULL if there is none
+static struct cs1550_hole *cs1550_hole_starting(long bit)
+{
+	struct cs1550_hole *h = cs1550_hole_by_start[cs1550_hole_hash(bit)];
 
-//register our new functions as the implementations of the syscalls
-static struct fuse_operations hello_oper = {
-    .getattr	= cs1550_getattr,
-    .readdir	= cs1550_readdir,
-    .mkdir	= cs1550_mkdir,
-	.rmdir = cs1550_rmdir,
-    .read	= cs1550_read,
-    .write	= cs1550_write,
-	.mknod	= cs1550_mknod,
-	.unlink = cs1550_unlink,
-	.truncate = cs1550_truncate,
-	.flush = cs1550_flush,
-	.open	= cs1550_open,
-};
+	while(h != NULL && h->start != bit)
+		h = h->start_next;
+	return h;
+}
 
-//Don't change this.
-int main(int argc, char *argv[])
+//the hole whose last bit is bit, NULL if there is none
+static struct cs1550_hole *cs1550_hole_ending(long bit)
 {
-	return fuse_main(argc, argv, &hello_oper, NULL);
+	struct cs1550_hole *h = cs1550_hole_by_end[cs1550_hole_hash(bit)];
+
+	while(h != NULL && h->start + h->len - 1 != bit)
+		h = h->end_next;
+	return h;
+}
+
+//double the buckets once the holes outnumber them two to one
+static int cs1550_hole_hash_grow(void)
+{
+	unsigned long nbuckets = cs1550_hole_by_start != NULL ? (cs1550_hole_mask + 1) * 2 : HOLE_HASH_BUCKETS;
+	unsigned long old = cs1550_hole_by_start != NULL ? cs1550_hole_mask + 1 : 0;
+	struct cs1550_hole **by_start, **by_end, **old_start = cs1550_hole_by_start;
+	unsigned long i;
+
+	if(cs1550_hole_by_start != NULL && (unsigned long) cs1550_hole_count <= 2 * (cs1550_hole_mask + 1))
+		return 0;
+
+	by_start = calloc(nbuckets, sizeof(struct cs1550_hole *));
+	by_end = calloc(nbuckets, sizeof(struct cs1550_hole *));
+	if(by_start == NULL || by_end == NULL)
+	{
+		free(by_start);
+		free(by_end);
+		return cs1550_hole_by_start != NULL ? 0 : -ENOMEM;	//a full table still works
+	}
+
+	free(cs1550_hole_by_end);
+	cs1550_hole_by_start = by_start;
+	cs1550_hole_by_end = by_end;
+	cs1550_hole_mask = nbuckets - 1;
+	for(i = 0; i < old; i++)
+	{
+		struct cs1550_hole *h = old_start[i];
+
+		while(h != NULL)
+		{
+			struct cs1550_hole *next = h->start_next;
+
+			cs1550_hole_link(h);
+			h = next;
+		}
+	}
+	free(old_start);
+	return 0;
+}
+
+//does h sort before a hole of len bits at start?
+static int cs1550_hole_below(const struct cs1550_hole *h, long len, long start)
+{
+	return h->len < len || (h->len == len && h->start < start);
+}
+
+//split t into the holes that sort before (len, start) and the rest
+static void cs1550_hole_split(struct cs1550_hole *t, long len, long start,
+		struct cs1550_hole **l, struct cs1550_hole **r)
+{
+	if(t == NULL)
+		*l = *r = NULL;
+	else if(cs1550_hole_below(t, len, start))
+	{
+		cs1550_hole_split(t->right, len, start, &t->right, r);
+		*l = t;
+	}
+	else
+	{
+		cs1550_hole_split(t->left, len, start, l, &t->left);
+		*r = t;
+	}
+}
+
+//join two treaps where every hole of l sorts before every hole of r
+static struct cs1550_hole *cs1550_hole_join(struct cs1550_hole *l, struct cs1550_hole *r)
+{
+	if(l == NULL)
+		return r;
+	if(r == NULL)
+		return l;
+	if(l->prio > r->prio)
+	{
+		l->right = cs1550_hole_join(l->right, r);
+		return l;
+	}
+	r->left = cs1550_hole_join(l, r->left);
+	return r;
+}
+
+//index a free run of len bits at start
+static int cs1550_hole_insert(long start, long len)
+{
+	struct cs1550_hole *h, *l, *r;
+
+	if(cs1550_hole_spare == NULL)
+	{
+		struct cs1550_hole_chunk *c = malloc(sizeof(struct cs1550_hole_chunk));
+		int i;
+
+		if(c == NULL)
+			return -ENOMEM;
+		c->next = cs1550_hole_chunks;
+		cs1550_hole_chunks = c;
+		for(i = 0; i < HOLE_CHUNK; i++)
+		{
+			c->holes[i].right = cs1550_hole_spare;
+			cs1550_hole_spare = &c->holes[i];
+		}
+	}
+	cs1550_hole_count++;
+	if(cs1550_hole_hash_grow() < 0)
+	{
+		cs1550_hole_count--;
+		return -ENOMEM;
+	}
+	h = cs1550_hole_spare;
+	cs1550_hole_spare = h->right;
+	h->start = start;
+	h->len = len;
+	h->prio = ((uint64_t) start + 1) * 0x9e3779b97f4a7c15ULL;
+	h->prio ^= h->prio >> 29;
+	h->left = h->right = NULL;
+
+	cs1550_hole_split(cs1550_holes, len, start, &l, &r);
+	cs1550_holes = cs1550_hole_join(cs1550_hole_join(l, h), r);
+	cs1550_hole_link(h);
+	return 0;
+}
+
+//take h out of the index and return it to the spares
+static void cs1550_hole_remove(struct cs1550_hole *h)
+{
+	struct cs1550_hole *l, *m, *r;
+
+	//h is the only hole at or after itself and before the next bit up
+	cs1550_hole_split(cs1550_holes, h->len, h->start, &l, &r);
+	cs1550_hole_split(r, h->len, h->start + 1, &m, &r);
+	cs1550_holes = cs1550_hole_join(l, r);
+	cs1550_hole_unlink(h);
+	cs1550_hole_count--;
+	h->right = cs1550_hole_spare;
+	cs1550_hole_spare = h;
+}
+
+//the smallest hole of at least len bits, the lowest of those that tie
+static struct cs1550_hole *cs1550_hole_fit(long len)
+{
+	struct cs1550_hole *t = cs1550_holes, *best = NULL;
+
+	while(t != NULL)
+	{
+		if(t->len >= len)
+		{
+			best = t;
+			t = t->left;
+		}
+		else
+			t = t->right;
+	}
+	return best;
+}
+
+static struct cs1550_hole *cs1550_hole_largest(void)
+{
+	struct cs1550_hole *t = cs1550_holes;
+
+	while(t != NULL && t->right != NULL)
+		t = t->right;
+	return t;
+}
+
+//mark the first len bits of h used, keeping whatever is left of it as a
+//hole, and return the first bit taken
+static long cs1550_hole_take(struct cs1550_hole *h, long len)
+{
+	long start = h->start, rest = h->len - len, i;
+
+	//h has just gone back to the spares, so this cannot run out
+	cs1550_hole_remove(h);
+	if(rest > 0)
+		cs1550_hole_insert(start + len, rest);
+	for(i = 0; i < len; i++)
+		cs1550_bitmap_set(start + i, 1);
+	return start;
+}
+
+//index a run of newly freed bits, merged with the holes on either side
+static void cs1550_hole_add(long start, long len)
+{
+	struct cs1550_hole *left = start > 0 ? cs1550_hole_ending(start - 1) : NULL;
+	struct cs1550_hole *right = start + len < cs1550_bitmap_bits ? cs1550_hole_starting(start + len) : NULL;
+
+	if(left != NULL)
+	{
+		start = left->start;
+		len += left->len;
+		cs1550_hole_remove(left);
+	}
+	if(right != NULL)
+	{
+		len += right->len;
+		cs1550_hole_remove(right);
+	}
+	if(cs1550_hole_insert(start, len) < 0)
+		printf("out of memory, %ld free blocks are lost until remount\n", len);
+}
+
+//clear len bits from bit, skipping any that are already clear, and index
+//them as free
+static void cs1550_bits_release(long bit, long len)
+{
+	long i = 0, from;
+
+	while(i < len)
+	{
+		while(i < len && !(cs1550_bitmap[(bit + i) / 64] >> ((bit + i) % 64) & 1))
+			i++;
+		from = i;
+		while(i < len && (cs1550_bitmap[(bit + i) / 64] >> ((bit + i) % 64) & 1))
+			cs1550_bitmap_set(bit + i++, 0);
+		if(i > from && cs1550_hole_by_start != NULL)
+			cs1550_hole_add(bit + from, i - from);
+	}
+}
+
+static void cs1550_holes_free(void)
+{
+	while(cs1550_hole_chunks != NULL)
+	{
+		struct cs1550_hole_chunk *c = cs1550_hole_chunks;
+
+		cs1550_hole_chunks = c->next;
+		free(c);
+	}
+	free(cs1550_hole_by_start);
+	free(cs1550_hole_by_end);
+	cs1550_holes = cs1550_hole_spare = NULL;
+	cs1550_hole_by_start = cs1550_hole_by_end = NULL;
+	cs1550_hole_mask = 0;
+	cs1550_hole_count = 0;
+}
+
+//index every free run of the bitmap
+static int cs1550_holes_build(void)
+{
+	long bit = 0;
+
+	cs1550_holes_free();
+	if(cs1550_hole_hash_grow() < 0)
+		return -ENOMEM;
+
+	while(bit < cs1550_bitmap_bits)
+	{
+		long start = cs1550_bitmap_next(bit, 0);
+		long end;
+
+		if(start >= cs1550_bitmap_bits)
+			break;
+		end = cs1550_bitmap_next(start, 1);
+		if(cs1550_hole_insert(start, end - start) < 0)
+		{
+			cs1550_holes_free();
+			return -ENOMEM;
+		}
+		bit = end;
+	}
+	return 0;
+}
+
+struct cs1550_run
+{
+	long start;		//first bit of the run
+	long len;		//number of bits
+};
+
+static int cs1550_run_by_start(const void *a, const void *b)
+{
+	long x = ((const struct cs1550_run *) a)->start;
+	long y = ((const struct cs1550_run *) b)->start;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Allocate n blocks into blocks[]. If a hole big enough starts at goal, the
+ * block a growing file would like next, the blocks come from there so the
+ * file stays in one piece; otherwise they come from the smallest hole that
+ * fits, leaving the big ones for big requests. When no hole is big enough
+ * the largest ones are used, with the smallest that fits for the remainder,
+ * so the result is split as few times as possible. Returns how many blocks
+ * were allocated, which is less than n only when the disk fills up.
+ */
+static long cs1550_alloc_search(long goal, long n, long *blocks)
+{
+	struct cs1550_hole *h;
+	struct cs1550_run *runs;
+	long nruns = 0, cap = 16, got = 0, i, j;
+
+	if(n <= 0 || cs1550_hole_by_start == NULL)
+		return 0;
+
+	h = goal > 0 && goal <= cs1550_bitmap_bits ? cs1550_hole_starting(goal - 1) : NULL;
+	if(h == NULL || h->len < n)
+		h = cs1550_hole_fit(n);
+	if(h != NULL)
+	{
+		long start = cs1550_hole_take(h, n);
+
+		for(i = 0; i < n; i++)
+			blocks[i] = start + i + 1;
+		if(cs1550_bitmap_sync() < 0)
+			return -1;
+		return n;
+	}
+
+	runs = malloc(cap * sizeof(struct cs1550_run));
+	if(runs == NULL)
+		return -1;
+	while(got < n && (h = cs1550_hole_largest()) != NULL)
+	{
+		if(nruns == cap)
+		{
+			struct cs1550_run *more = realloc(runs, 2 * cap * sizeof(struct cs1550_run));
+			if(more == NULL)
+				break;
+			runs = more;
+			cap *= 2;
+		}
+		if(h->len >= n - got)
+			h = cs1550_hole_fit(n - got);
+		runs[nruns].len = h->len < n - got ? h->len : n - got;
+		runs[nruns].start = cs1550_hole_take(h, runs[nruns].len);
+		got += runs[nruns++].len;
+	}
+
+	//lay the pieces out in disk order so the chain still runs forwards
+	qsort(runs, nruns, sizeof(struct cs1550_run), cs1550_run_by_start);
+	got = 0;
+	for(i = 0; i < nruns; i++)
+		for(j = 0; j < runs[i].len; j++)
+			blocks[got++] = runs[i].start + j + 1;
+	free(runs);
+
+	if(got == 0)
+		printf("didn't find a free bit\n");
+	if(cs1550_bitmap_sync() < 0)
+		return -1;
+	return got;
+}
+
+//the bitmap, its dirty flags and the free space index belong to whoever
+//holds this
+static pthread_mutex_t cs1550_alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//goal is the block the caller would like first, 0 for anywhere
+static long cs1550_alloc_blocks(long goal, long n, long *blocks)
+{
+	long got;
+
+	pthread_mutex_lock(&cs1550_alloc_lock);
+	got = cs1550_alloc_search(goal, n, blocks);
+	pthread_mutex_unlock(&cs1550_alloc_lock);
+	return got;
+}
+
+static long cs1550_find_free_block()
+{
+	long block;
+
+	if(cs1550_alloc_blocks(0, 1, &block) != 1)
+		return -1;
+	return block;
+}
+
+static int cs1550_mark_blocks_free(long block){
+
+  if(block <=0){
+    printf("error\n");
+    return -1;
+  }
+
+  //we're freeing everything this points to too, a stretch of
+  //consecutive blocks at a time
+  long run = block, len = 0;
+  while(block > 0 && block <= cs1550_bitmap_bits){
+    long next = cs1550_fat_next(block);
+    //free current block
+    cs1550_fat[block] = FAT_UNKNOWN;
+    len++;
+    if(next != block + 1){
+      pthread_mutex_lock(&cs1550_alloc_lock);
+      cs1550_bits_release(run - 1, len);
+      pthread_mutex_unlock(&cs1550_alloc_lock);
+      run = next;
+      len = 0;
+    }
+    //get next block
+    block = next;
+  }
+  if(len > 0){
+    pthread_mutex_lock(&cs1550_alloc_lock);
+    cs1550_bits_release(run - 1, len);
+    pthread_mutex_unlock(&cs1550_alloc_lock);
+  }
+
+  pthread_mutex_lock(&cs1550_alloc_lock);
+  int ret = cs1550_bitmap_sync();
+  pthread_mutex_unlock(&cs1550_alloc_lock);
+  return ret;
+}
+
+//clear the bitmap bit of a single block
+static int cs1550_free_block(long block)
+{
+	int ret;
+
+	if(block <= 0 || block > cs1550_bitmap_bits)
+		return -1;
+	pthread_mutex_lock(&cs1550_alloc_lock);
+	cs1550_bits_release(block - 1, 1);
+	ret = cs1550_bitmap_sync();
+	pthread_mutex_unlock(&cs1550_alloc_lock);
+	return ret;
+}
+
+//clear the bitmap bits of len blocks from start
+static int cs1550_free_run(long start, long len)
+{
+	int ret;
+
+	if(start <= 0 || len <= 0 || start + len - 1 > cs1550_bitmap_bits)
+		return -1;
+	pthread_mutex_lock(&cs1550_alloc_lock);
+	cs1550_bits_release(start - 1, len);
+	ret = cs1550_bitmap_sync();
+	pthread_mutex_unlock(&cs1550_alloc_lock);
+	return ret;
+}
+
+//FNV-1a over a nul terminated name
+static unsigned long cs1550_name_hash(const char *name)
+{
+	unsigned long h = 2166136261UL;
+
+	while(*name != '\0')
+	{
+		h ^= (unsigned char) *name++;
+		h *= 16777619UL;
+	}
+	return h;
+}
+
+/*
+ * In-memory index of the root directory. It is loaded from the root's blocks
+ * when the file system is mounted and kept in step by mkdir and rmdir, so
+ * resolving a directory name never touches the disk. Like a directory, the
+ * root grows a block at a time and its hash table doubles as it fills.
+ */
+
+#define	ROOT_HASH_BUCKETS 64
+#define	FILE_HASH_BUCKETS 32
+
+//an extent-mapped file's runs, loaded from its extent blocks on first use
+struct cs1550_extent_map
+{
+	struct cs1550_extent *ext;			//the runs in file order
+	long *first;						//file block index each run starts at
+	long n;								//runs in ext
+	long cap;							//room in ext and first
+	long *meta;							//the extent blocks in order
+	long nmeta;							//blocks in meta
+	long nblocks;						//file blocks the runs cover
+	int loaded;
+};
+
+//one file of a directory, as last written to its directory block
+struct cs1550_file_node
+{
+	char fname[MAX_FILENAME + 1];		//filename
+	char fext[MAX_EXTENSION + 1];		//extension
+	int slot;							//index into files[] of the directory
+	unsigned long generation;			//0 if it was on disk at mount, else
+										//set when it was made
+	size_t fsize;						//file size
+	long nStartBlock;					//where the first block is on disk, or
+										//minus the first extent block
+	struct cs1550_file_node *hash_next;	//next node in the same bucket
+
+	long *chain;						//the file's blocks in order, as far as known
+	long chain_len;						//blocks in chain
+	long chain_cap;						//room in chain
+	int chain_done;						//chain reaches the end of the file
+	struct cs1550_extent_map emap;		//runs of an extent-mapped file
+	int dir_loc;						//root slot of the directory
+	struct cs1550_dir_node *dir;		//and the directory itself
+	pthread_mutex_t lock;				//guards everything below, the chain
+										//vector and the file's blocks
+	int open_count;						//handles open on this file
+	int unlinked;						//unlinked while open, freed on last release
+	int opened;							//opened before, so the kernel's pages are ours
+
+	char *wb;							//write-behind buffer, NULL if none
+	off_t wb_off;						//file offset of wb[0]
+	size_t wb_len;						//bytes buffered
+	size_t wb_base;						//size on disk when the buffer was started
+	struct cs1550_file_node *wb_next;	//next file holding a buffer
+};
+
+typedef struct cs1550_file_node cs1550_file_node;
+
+struct cs1550_dir_node
+{
+	char dname[MAX_FILENAME + 1];		//directory name
+	int slot;							//index into root.directories
+	unsigned long generation;			//as for a file
+	long nStartBlock;					//where the directory block is on disk
+	struct cs1550_dir_node *hash_next;	//next node in the same bucket
+
+	pthread_rwlock_t lock;				//guards the file index below
+	pthread_mutex_t ent_lock;			//serialises rewrites of the blocks,
+										//and growing blocks[]
+
+	//the files are indexed the first time the directory is looked into
+	int files_loaded;
+	long *blocks;						//the directory's blocks in order
+	long nblocks;						//blocks in blocks[]
+	cs1550_file_node **file_hash;		//buckets, a power of two of them
+	unsigned long file_mask;			//buckets - 1
+	cs1550_file_node **file_slots;		//slot s is entry s % MAX_FILES_IN_DIR
+										//of blocks[s / MAX_FILES_IN_DIR]
+	int nslots;							//nblocks * MAX_FILES_IN_DIR
+	int nfiles;							//files in the directory
+	int free_hint;						//no free slot below this one
+};
+
+typedef struct cs1550_dir_node cs1550_dir_node;
+
+static cs1550_dir_node **cs1550_root_hash = NULL;	//buckets, a power of two
+static unsigned long cs1550_root_mask = 0;			//buckets - 1
+static cs1550_dir_node **cs1550_root_slots = NULL;	//slot s is entry
+													//s % MAX_DIRS_IN_ROOT of
+													//root block s / MAX_DIRS_IN_ROOT
+static int cs1550_root_nslots = 0;
+static int cs1550_root_ndirs = 0;
+static int cs1550_root_free_hint = 0;				//no free slot below this one
+static long *cs1550_root_blocks = NULL;				//the root's blocks in order
+static long cs1550_root_nblocks = 0;
+
+//guards the root index and the root block
+static pthread_rwlock_t cs1550_root_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+//last generation handed out. A slot freed by unlink or rmdir is taken by
+//the next file or directory made, so the low-level build tells the two
+//apart by this rather than by the inode number alone
+static unsigned long cs1550_generation = 0;
+static pthread_mutex_t cs1550_generation_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long cs1550_next_generation(void)
+{
+	unsigned long g;
+
+	pthread_mutex_lock(&cs1550_generation_lock);
+	g = ++cs1550_generation;
+	pthread_mutex_unlock(&cs1550_generation_lock);
+	return g;
+}
+
+static void cs1550_file_node_free(cs1550_file_node *node)
+{
+	if(node == NULL)
+		return;
+	pthread_mutex_destroy(&node->lock);
+	free(node->chain);
+	free(node->emap.ext);
+	free(node->emap.first);
+	free(node->emap.meta);
+	free(node);
+}
+
+//double the buckets once there are more than two directories to a bucket
+static int cs1550_root_hash_grow(void)
+{
+	unsigned long nbuckets = cs1550_root_hash != NULL ? (cs1550_root_mask + 1) * 2 : ROOT_HASH_BUCKETS;
+	cs1550_dir_node **hash;
+	int i;
+
+	if(cs1550_root_hash != NULL && (unsigned long) cs1550_root_ndirs <= 2 * (cs1550_root_mask + 1))
+		return 0;
+
+	hash = calloc(nbuckets, sizeof(cs1550_dir_node *));
+	if(hash == NULL)
+		return cs1550_root_hash != NULL ? 0 : -ENOMEM;	//a full table still works
+
+	free(cs1550_root_hash);
+	cs1550_root_hash = hash;
+	cs1550_root_mask = nbuckets - 1;
+	for(i = 0; i < cs1550_root_nslots; i++)
+	{
+		cs1550_dir_node *node = cs1550_root_slots[i];
+		unsigned long h;
+
+		if(node == NULL)
+			continue;
+		h = cs1550_name_hash(node->dname) & cs1550_root_mask;
+		node->hash_next = hash[h];
+		hash[h] = node;
+	}
+	return 0;
+}
+
+//add block to the end of the root's block list, with a slot for each of
+//its entries
+static int cs1550_root_add_block(long block)
+{
+	long *blocks = realloc(cs1550_root_blocks, (cs1550_root_nblocks + 1) * sizeof(long));
+	cs1550_dir_node **slots;
+
+	if(blocks == NULL)
+		return -ENOMEM;
+	cs1550_root_blocks = blocks;
+	slots = realloc(cs1550_root_slots, (cs1550_root_nslots + MAX_DIRS_IN_ROOT) * sizeof(cs1550_dir_node *));
+	if(slots == NULL)
+		return -ENOMEM;
+	memset(slots + cs1550_root_nslots, 0, MAX_DIRS_IN_ROOT * sizeof(cs1550_dir_node *));
+	cs1550_root_slots = slots;
+	cs1550_root_blocks[cs1550_root_nblocks++] = block;
+	cs1550_root_nslots += MAX_DIRS_IN_ROOT;
+	return 0;
+}
+
+//root block holding the entry of the directory in slot
+static long cs1550_root_slot_block(int slot)
+{
+	return cs1550_root_blocks[slot / MAX_DIRS_IN_ROOT];
+}
+
+//give a full root another block, linked on after its last one
+static int cs1550_root_grow(void)
+{
+	cs1550_root_directory *root;
+	long last = cs1550_root_blocks[cs1550_root_nblocks - 1];
+	long block = cs1550_find_free_block();
+	int ret;
+
+	if(block <= 0)
+	{
+		printf("no free block to grow the root\n");
+		return -ENOSPC;
+	}
+	ret = cs1550_root_add_block(block);
+	if(ret < 0)
+	{
+		cs1550_free_block(block);
+		return ret;
+	}
+
+	//the new block is written before anything points at it
+	root = cs1550_block_alloc();
+	if(root == NULL)
+		ret = -ENOMEM;
+	else
+	{
+		memset(root, 0, BLOCK_SIZE);
+		if(cs1550_write_block(block, root) < 0 || cs1550_read_block(last, root) < 0)
+			ret = -EIO;
+		else
+		{
+			cs1550_set_next_block(root, block);
+			if(cs1550_write_block(last, root) < 0)
+				ret = -EIO;
+		}
+		free(root);
+	}
+	if(ret < 0)
+	{
+		printf("error linking a new block into the root\n");
+		cs1550_root_nblocks--;
+		cs1550_root_nslots -= MAX_DIRS_IN_ROOT;
+		cs1550_free_block(block);
+	}
+	return ret;
+}
+
+static int cs1550_root_index_add(const char *dname, int slot, long nStartBlock)
+{
+	cs1550_dir_node *node = calloc(1, sizeof(cs1550_dir_node));
+	unsigned long h;
+
+	if(node == NULL)
+		return -ENOMEM;
+	cs1550_root_ndirs++;
+	if(cs1550_root_hash_grow() < 0)
+	{
+		cs1550_root_ndirs--;
+		free(node);
+		return -ENOMEM;
+	}
+
+	strncpy(node->dname, dname, MAX_FILENAME);
+	node->dname[MAX_FILENAME] = '\0';
+	node->slot = slot;
+	pthread_rwlock_init(&node->lock, NULL);
+	pthread_mutex_init(&node->ent_lock, NULL);
+	node->nStartBlock = nStartBlock;
+	h = cs1550_name_hash(node->dname) & cs1550_root_mask;
+	node->hash_next = cs1550_root_hash[h];
+	cs1550_root_hash[h] = node;
+	cs1550_root_slots[slot] = node;
+	return 0;
+}
+
+//drop the directory's file index, which is built again on the next lookup
+static void cs1550_file_index_free(cs1550_dir_node *d)
+{
+	int i;
+
+	for(i = 0; i < d->nslots; i++)
+		cs1550_file_node_free(d->file_slots[i]);
+	free(d->file_slots);
+	free(d->file_hash);
+	free(d->blocks);
+	d->file_slots = NULL;
+	d->file_hash = NULL;
+	d->blocks = NULL;
+	d->nblocks = 0;
+	d->nslots = 0;
+	d->nfiles = 0;
+	d->free_hint = 0;
+	d->files_loaded = 0;
+}
+
+static void cs1550_root_index_remove(int slot)
+{
+	cs1550_dir_node *node = cs1550_root_slots[slot];
+	cs1550_dir_node **p;
+
+	if(node == NULL)
+		return;
+
+	cs1550_file_index_free(node);
+
+	p = &cs1550_root_hash[cs1550_name_hash(node->dname) & cs1550_root_mask];
+	while(*p != node)
+		p = &(*p)->hash_next;
+	*p = node->hash_next;
+	cs1550_root_slots[slot] = NULL;
+	cs1550_root_ndirs--;
+	if(slot < cs1550_root_free_hint)
+		cs1550_root_free_hint = slot;
+	pthread_rwlock_destroy(&node->lock);
+	pthread_mutex_destroy(&node->ent_lock);
+	free(node);
+}
+
+static void cs1550_root_index_free(void)
+{
+	int i;
+
+	for(i = 0; i < cs1550_root_nslots; i++)
+		cs1550_root_index_remove(i);
+	free(cs1550_root_slots);
+	free(cs1550_root_hash);
+	free(cs1550_root_blocks);
+	cs1550_root_slots = NULL;
+	cs1550_root_hash = NULL;
+	cs1550_root_blocks = NULL;
+	cs1550_root_nslots = 0;
+	cs1550_root_nblocks = 0;
+	cs1550_root_ndirs = 0;
+	cs1550_root_free_hint = 0;
+}
+
+//walk the root's blocks from its first one and index every directory in them
+static int cs1550_root_index_load(void)
+{
+	cs1550_root_directory *root = cs1550_block_alloc();
+	long block = cs1550_root_block;
+	int i, ret = 0;
+
+	cs1550_root_index_free();
+	if(root == NULL)
+		return -ENOMEM;
+	do
+	{
+		//a link out of the data area, or more blocks than the disk has,
+		//means the chain is damaged; keep what was read
+		if(block < 0 || block >= cs1550_bitmap_start()
+				|| cs1550_root_nblocks >= cs1550_disk_blocks)
+		{
+			printf("the root has a bad block link %ld\n", block);
+			break;
+		}
+		if(cs1550_read_block(block, root) < 0)
+		{
+			printf("error reading the root directory\n");
+			ret = -EIO;
+			break;
+		}
+		if(cs1550_root_add_block(block) < 0)
+			ret = -ENOMEM;
+
+		for(i = 0; ret == 0 && i < MAX_DIRS_IN_ROOT; i++)
+		{
+			if(root->directories[i].dname[0] == '\0')
+				continue;
+			if(cs1550_root_index_add(root->directories[i].dname,
+					cs1550_root_nslots - MAX_DIRS_IN_ROOT + i,
+					root->directories[i].nStartBlock) < 0)
+				ret = -ENOMEM;
+		}
+		block = cs1550_next_block(root);
+	} while(ret == 0 && block != 0);
+	free(root);
+	return ret < 0 ? ret : cs1550_root_hash_grow();
+}
+
+static int cs1550_find_dir_loc(char* dir)
+{
+	cs1550_dir_node *node;
+
+	if(cs1550_root_hash == NULL)
+		return -ENOENT;
+	node = cs1550_root_hash[cs1550_name_hash(dir) & cs1550_root_mask];
+	while(node != NULL)
+	{
+		if(strcmp(node->dname, dir) == 0)
+			return node->slot;
+		node = node->hash_next;
+	}
+	return -ENOENT; //not found
+}
+
+
+/*
+ * Per-directory file index, keyed on the full 8.3 name. It is built from the
+ * directory's blocks the first time a directory is searched, and mknod,
+ * write and unlink update it alongside the blocks so it never has to be
+ * rebuilt. A directory starts as one block and grows a block at a time as
+ * it fills; the hash table doubles with it, so finding a name stays a
+ * bucket walk however many files there are.
+ */
+
+static unsigned long cs1550_file_hash(const char *fname, const char *fext)
+{
+	return cs1550_name_hash(fname) * 31 + cs1550_name_hash(fext);
+}
+
+//double the buckets once there are more than two files to a bucket
+static int cs1550_file_hash_grow(cs1550_dir_node *d)
+{
+	unsigned long nbuckets = d->file_hash != NULL ? (d->file_mask + 1) * 2 : FILE_HASH_BUCKETS;
+	cs1550_file_node **hash;
+	int i;
+
+	if(d->file_hash != NULL && (unsigned long) d->nfiles <= 2 * (d->file_mask + 1))
+		return 0;
+
+	hash = calloc(nbuckets, sizeof(cs1550_file_node *));
+	if(hash == NULL)
+		return d->file_hash != NULL ? 0 : -ENOMEM;	//a full table still works
+
+	free(d->file_hash);
+	d->file_hash = hash;
+	d->file_mask = nbuckets - 1;
+	for(i = 0; i < d->nslots; i++)
+	{
+		cs1550_file_node *node = d->file_slots[i];
+		unsigned long h;
+
+		if(node == NULL)
+			continue;
+		h = cs1550_file_hash(node->fname, node->fext) & d->file_mask;
+		node->hash_next = hash[h];
+		hash[h] = node;
+	}
+	return 0;
+}
+
+//add block to the end of the directory's block list, with a slot for each
+//of its entries
+static int cs1550_dir_add_block(cs1550_dir_node *d, long block)
+{
+	long *blocks = realloc(d->blocks, (d->nblocks + 1) * sizeof(long));
+	cs1550_file_node **slots;
+
+	if(blocks == NULL)
+		return -ENOMEM;
+	d->blocks = blocks;
+	slots = realloc(d->file_slots, (d->nslots + MAX_FILES_IN_DIR) * sizeof(cs1550_file_node *));
+	if(slots == NULL)
+		return -ENOMEM;
+	memset(slots + d->nslots, 0, MAX_FILES_IN_DIR * sizeof(cs1550_file_node *));
+	d->file_slots = slots;
+	d->blocks[d->nblocks++] = block;
+	d->nslots += MAX_FILES_IN_DIR;
+	return 0;
+}
+
+//block holding the entry of the file in slot
+static long cs1550_slot_block(cs1550_dir_node *d, int slot)
+{
+	return d->blocks[slot / MAX_FILES_IN_DIR];
+}
+
+//give a full directory another block, linked on after its last one
+static int cs1550_dir_grow(cs1550_dir_node *d)
+{
+	cs1550_directory_entry *dir;
+	long last = d->blocks[d->nblocks - 1];
+	long block = cs1550_find_free_block();
+	int ret;
+
+	if(block <= 0)
+	{
+		printf("no free block to grow directory %s\n", d->dname);
+		return -ENOSPC;
+	}
+	ret = cs1550_dir_add_block(d, block);
+	if(ret < 0)
+	{
+		cs1550_free_block(block);
+		return ret;
+	}
+
+	//the new block is written before anything points at it
+	dir = cs1550_block_alloc();
+	if(dir == NULL)
+		ret = -ENOMEM;
+	else
+	{
+		memset(dir, 0, BLOCK_SIZE);
+		if(cs1550_write_block(block, dir) < 0 || cs1550_read_block(last, dir) < 0)
+			ret = -EIO;
+		else
+		{
+			cs1550_set_next_block(dir, block);
+			if(cs1550_write_block(last, dir) < 0)
+				ret = -EIO;
+		}
+		free(dir);
+	}
+	if(ret < 0)
+	{
+		printf("error linking a new block into directory %s\n", d->dname);
+		d->nblocks--;
+		d->nslots -= MAX_FILES_IN_DIR;
+		cs1550_free_block(block);
+	}
+	return ret;
+}
+
+static int cs1550_file_index_add(cs1550_dir_node *d, int slot,
+		const struct cs1550_file_directory *f)
+{
+	cs1550_file_node *node = calloc(1, sizeof(cs1550_file_node));
+	unsigned long h;
+
+	if(node == NULL)
+		return -ENOMEM;
+
+	memcpy(node->fname, f->fname, MAX_FILENAME + 1);
+	memcpy(node->fext, f->fext, MAX_EXTENSION + 1);
+	node->fname[MAX_FILENAME] = '\0';
+	node->fext[MAX_EXTENSION] = '\0';
+	node->slot = slot;
+	node->dir_loc = d->slot;
+	node->dir = d;
+	pthread_mutex_init(&node->lock, NULL);
+	node->fsize = f->fsize;
+	node->nStartBlock = f->nStartBlock;
+
+	d->nfiles++;
+	if(cs1550_file_hash_grow(d) < 0)
+	{
+		d->nfiles--;
+		cs1550_file_node_free(node);
+		return -ENOMEM;
+	}
+	d->file_slots[slot] = node;
+	h = cs1550_file_hash(node->fname, node->fext) & d->file_mask;
+	node->hash_next = d->file_hash[h];
+	d->file_hash[h] = node;
+	return 0;
+}
+
+static void cs1550_file_index_remove(cs1550_dir_node *d, int slot)
+{
+	cs1550_file_node *node = d->file_slots[slot];
+	cs1550_file_node **p;
+
+	if(node == NULL)
+		return;
+
+	p = &d->file_hash[cs1550_file_hash(node->fname, node->fext) & d->file_mask];
+	while(*p != node)
+		p = &(*p)->hash_next;
+	*p = node->hash_next;
+	d->file_slots[slot] = NULL;
+	d->nfiles--;
+	if(slot < d->free_hint)
+		d->free_hint = slot;
+
+	//the caller frees the node, or the last release does if it is open
+	node->unlinked = 1;
+}
+
+//walk the directory's blocks and index every file in them
+static int cs1550_file_index_read(cs1550_dir_node *d)
+{
+	cs1550_directory_entry *entry = cs1550_block_alloc();
+	long block = d->nStartBlock;
+	int i, ret = 0;
+
+	if(entry == NULL)
+		return -ENOMEM;
+	while(ret == 0 && block > 0)
+	{
+		//a link out of the data area, or more blocks than the disk has,
+		//means the chain is damaged; keep what was read
+		if(block >= cs1550_bitmap_start() || d->nblocks >= cs1550_disk_blocks)
+		{
+			printf("directory %s has a bad block link %ld\n", d->dname, block);
+			break;
+		}
+		if(cs1550_read_block(block, entry) < 0)
+		{
+			printf("error reading directory entry\n");
+			ret = -EIO;
+			break;
+		}
+		if(cs1550_dir_add_block(d, block) < 0)
+			ret = -ENOMEM;
+
+		for(i = 0; ret == 0 && i < MAX_FILES_IN_DIR; i++)
+		{
+			if(entry->files[i].fname[0] == '\0')
+				continue;
+			if(cs1550_file_index_add(d, d->nslots - MAX_FILES_IN_DIR + i, &entry->files[i]) < 0)
+				ret = -ENOMEM;
+		}
+		block = cs1550_next_block(entry);
+	}
+	free(entry);
+	return ret < 0 ? ret : cs1550_file_hash_grow(d);
+}
+
+//index the directory unless it already is, leaving nothing half built
+static int cs1550_file_index_load(cs1550_dir_node *d)
+{
+	int ret;
+
+	if(d->files_loaded)
+		return 0;
+	ret = cs1550_file_index_read(d);
+	if(ret < 0)
+		cs1550_file_index_free(d);
+	else
+		d->files_loaded = 1;
+	return ret;
+}
+
+//the indexed file in slot file_loc of the directory in root slot dir_loc
+static cs1550_file_node *cs1550_file_at(int dir_loc, int file_loc)
+{
+	cs1550_dir_node *d = cs1550_root_slots[dir_loc];
+
+	if(file_loc < 0 || file_loc >= d->nslots)
+		return NULL;
+	return d->file_slots[file_loc];
+}
+
+static int cs1550_find_file_loc(int dir_loc, char * file, char * ext, size_t * fsize)
+{
+	cs1550_dir_node *d = cs1550_root_slots[dir_loc];
+	cs1550_file_node *node;
+
+	if(cs1550_file_index_load(d) < 0)
+		return -EIO;
+
+	node = d->file_hash[cs1550_file_hash(file, ext) & d->file_mask];
+	while(node != NULL)
+	{
+		if(strcmp(node->fname, file) == 0 && strcmp(node->fext, ext) == 0)
+		{
+			if(fsize!=NULL)
+			{
+				pthread_mutex_lock(&node->lock);
+				*fsize = node->fsize;
+				pthread_mutex_unlock(&node->lock);
+			}
+			return node->slot;
+		}
+		node = node->hash_next;
+	}
+	return -ENOENT;
+}
+
+static void cs1550_stat_dir(struct stat *stbuf)
+{
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_mode = S_IFDIR | 0755;
+	stbuf->st_nlink = 2;
+}
+
+static void cs1550_stat_file(struct stat *stbuf, size_t fsize)
+{
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_mode = S_IFREG | 0666;
+	stbuf->st_nlink = 1;
+	stbuf->st_size = fsize;
+}
+
+/*
+ * Locking. FUSE runs the operations on several threads, so:
+ *
+ *	cs1550_root_lock	root index and root block; written by mkdir and rmdir,
+ *						read by every path lookup
+ *	dir->lock			a directory's file index; written by mknod and
+ *						unlink, read by lookups in the directory
+ *	file->lock			a file's size, blocks, chain vector, write-behind
+ *						buffer and the handles open on it
+ *	dir->ent_lock		read-modify-write of the directory block, which size
+ *						updates do under the file's lock instead of dir->lock
+ *	cs1550_alloc_lock	the bitmap
+ *	cs1550_wb_lock		the list of files holding a write-behind buffer
+ *	cs1550_cache_lock	the buffer cache
+ *	cs1550_generation_lock	the generation counter
+ *
+ * and they are taken in that order. Reads and writes through an open handle
+ * only take the file's lock, so different files proceed in parallel.
+ */
+
+static void cs1550_dir_lock(cs1550_dir_node *d, int write)
+{
+	if(write)
+	{
+		pthread_rwlock_wrlock(&d->lock);
+		cs1550_file_index_load(d);
+		return;
+	}
+
+	//the first reader in builds the index, which needs the lock to itself
+	pthread_rwlock_rdlock(&d->lock);
+	if(!d->files_loaded)
+	{
+		pthread_rwlock_unlock(&d->lock);
+		pthread_rwlock_wrlock(&d->lock);
+		cs1550_file_index_load(d);
+		pthread_rwlock_unlock(&d->lock);
+		pthread_rwlock_rdlock(&d->lock);
+	}
+}
+
+/*
+ * Take the root lock for reading and, if path starts with a directory that
+ * exists, that directory's lock for reading or writing. Returns the locked
+ * directory, or NULL if there is none.
+ */
+static cs1550_dir_node *cs1550_lock_path(const char *path, int write)
+{
+	char directory[MAX_FILENAME *2];
+	int loc;
+
+	memset(directory, 0, sizeof(directory));
+	sscanf(path, "/%15[^/]", directory);
+
+	pthread_rwlock_rdlock(&cs1550_root_lock);
+	loc = cs1550_find_dir_loc(directory);
+	if(loc < 0)
+		return NULL;
+	cs1550_dir_lock(cs1550_root_slots[loc], write);
+	return cs1550_root_slots[loc];
+}
+
+static void cs1550_unlock_path(cs1550_dir_node *d)
+{
+	if(d != NULL)
+		pthread_rwlock_unlock(&d->lock);
+	pthread_rwlock_unlock(&cs1550_root_lock);
+}
+
+/*
+ * Open file handles. open and create resolve the path once and park one of
+ * these in fi->fh, so read and write go straight to the indexed file and
+ * resume walking the chain from where the previous call on the handle left
+ * off instead of from nStartBlock.
+ */
+struct cs1550_handle
+{
+	int dir_loc;				//root slot of the directory
+	int file_loc;				//slot of the file in the directory
+	cs1550_file_node *node;		//indexed entry, which tracks the size
+	long pos_index;				//position in the chain of pos_block
+	long pos_block;				//last block visited, 0 if none yet
+	long ra_expect;				//block index a sequential read would start at
+	long ra_window;				//readahead window in blocks, 0 when random
+	long ra_issued;				//blocks below this index have been queued
+	int path_locked;			//throwaway handle holding the path's locks
+};
+
+typedef struct cs1550_handle cs1550_handle;
+
+/*
+ * Split the last part of a path, or a name the low-level build is given,
+ * into its filename and extension, with the same errors as
+ * cs1550_split_path.
+ */
+static int cs1550_split_name(const char *name, char *filename, char *extension)
+{
+	const char *dot = strchr(name, '.');
+	size_t len = dot != NULL ? (size_t) (dot - name) : strlen(name);
+
+	memset(filename, 0, MAX_FILENAME + 1);
+	memset(extension, 0, MAX_EXTENSION + 1);
+
+	if(len == 0 || strchr(name, '/') != NULL)
+		return -ENOENT;
+	if(len > MAX_FILENAME)
+		return -ENAMETOOLONG;
+	memcpy(filename, name, len);
+	if(dot != NULL)
+	{
+		if(strlen(dot + 1) > MAX_EXTENSION)
+			return -ENAMETOOLONG;
+		strcpy(extension, dot + 1);
+	}
+	return 0;
+}
+
+/*
+ * Split a path into its directory, filename and extension. Names that
+ * could never have been created are rejected up front, so the
+ * probes shells and editors make for swap files, .git and the like never
+ * get as far as the indexes: a part longer than 8.3 allows is
+ * -ENAMETOOLONG, a file name that starts with a dot or anything below a
+ * second level is -ENOENT. Lookups treat both as -ENOENT.
+ */
+static int cs1550_split_path(const char *path, char *directory, char *filename,
+		char *extension)
+{
+	const char *slash;
+	size_t len;
+
+	memset(directory, 0, MAX_FILENAME + 1);
+	memset(filename, 0, MAX_FILENAME + 1);
+	memset(extension, 0, MAX_EXTENSION + 1);
+
+	if(path[0] != '/')
+		return -ENOENT;
+	path++;
+	slash = strchr(path, '/');
+	len = slash != NULL ? (size_t) (slash - path) : strlen(path);
+	if(len == 0)
+		return -ENOENT;
+	if(len > MAX_FILENAME)
+		return -ENAMETOOLONG;
+	memcpy(directory, path, len);
+	if(slash == NULL || slash[1] == '\0')
+		return 0;
+
+	return cs1550_split_name(slash + 1, filename, extension);
+}
+
+//split a path and find the file it names
+static int cs1550_resolve(const char *path, int *dir_loc, int *file_loc)
+{
+	char directory[MAX_FILENAME + 1];
+	char filename [MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1];
+
+	if(cs1550_split_path(path, directory, filename, extension) < 0)
+		return -ENOENT;
+
+	*dir_loc = cs1550_find_dir_loc(directory);
+	if(*dir_loc<0)
+		return -ENOENT;
+	if(filename[0]=='\0')
+		return -EISDIR;
+
+	*file_loc = cs1550_find_file_loc(*dir_loc, filename, extension, NULL);
+	if(*file_loc<0)
+		return -ENOENT;
+	return 0;
+}
+
+static void cs1550_handle_init(cs1550_handle *h, int dir_loc, int file_loc)
+{
+	h->dir_loc = dir_loc;
+	h->file_loc = file_loc;
+	h->node = cs1550_file_at(dir_loc, file_loc);
+	h->pos_index = 0;
+	h->pos_block = 0;
+	h->ra_expect = 0;
+	h->ra_window = 0;
+	h->ra_issued = 0;
+	h->path_locked = 0;
+}
+
+/*
+ * The handle open put in fi, or a throwaway one filled in from path, with
+ * its file locked. A throwaway handle also holds the path's locks, which
+ * keep the file from being unlinked under it. Undone by cs1550_put_handle.
+ */
+static int cs1550_get_handle(const char *path, struct fuse_file_info *fi,
+		cs1550_handle *tmp, cs1550_handle **h)
+{
+	cs1550_dir_node *d;
+	int dir_loc, file_loc, ret;
+
+	if(fi != NULL && fi->fh != 0)
+	{
+		*h = (cs1550_handle *) (uintptr_t) fi->fh;
+		pthread_mutex_lock(&(*h)->node->lock);
+		return 0;
+	}
+	//the low-level build always has a handle
+	if(path == NULL)
+		return -EBADF;
+
+	d = cs1550_lock_path(path, 0);
+	ret = cs1550_resolve(path, &dir_loc, &file_loc);
+	if(ret < 0)
+	{
+		cs1550_unlock_path(d);
+		return ret;
+	}
+	cs1550_handle_init(tmp, dir_loc, file_loc);
+	tmp->path_locked = 1;
+	pthread_mutex_lock(&tmp->node->lock);
+	*h = tmp;
+	return 0;
+}
+
+static void cs1550_put_handle(cs1550_handle *h)
+{
+	pthread_mutex_unlock(&h->node->lock);
+	if(h->path_locked)
+		cs1550_unlock_path(h->node->dir);
+}
+
+static int cs1550_chain_append(cs1550_file_node *node, const long *blocks, long n)
+{
+	if(node->chain_len + n > node->chain_cap)
+	{
+		long cap = node->chain_cap * 2;
+		long *more;
+
+		while(cap < node->chain_len + n)
+			cap *= 2;
+		more = realloc(node->chain, cap * sizeof(long));
+		if(more == NULL)
+			return -ENOMEM;
+		node->chain = more;
+		node->chain_cap = cap;
+	}
+	memcpy(node->chain + node->chain_len, blocks, n * sizeof(long));
+	node->chain_len += n;
+	return 0;
+}
+
+/*
+ * Extend the file's block vector through index by following the FAT, or to
+ * the end of the chain if it is shorter. The vector is only built as far as
+ * something has asked for, so opening a large file does not walk all of it.
+ */
+static int cs1550_chain_load(cs1550_file_node *node, long index)
+{
+	long block;
+
+	if(node->chain == NULL)
+	{
+		node->chain_cap = 16;
+		node->chain_len = 0;
+		node->chain_done = node->nStartBlock <= 0;
+		node->chain = malloc(node->chain_cap * sizeof(long));
+		if(node->chain == NULL)
+			return -ENOMEM;
+		if(node->nStartBlock > 0)
+			node->chain[node->chain_len++] = node->nStartBlock;
+	}
+
+	while(!node->chain_done && node->chain_len <= index)
+	{
+		block = cs1550_fat_next(node->chain[node->chain_len - 1]);
+		if(block <= 0 || node->chain_len >= cs1550_bitmap_bits)
+		{
+			node->chain_done = 1;
+			break;
+		}
+		if(cs1550_chain_append(node, &block, 1) < 0)
+			return -ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * Read the index'th block of the handle's chain into file and return its
+ * block number. Returns 0 if the chain ends first, leaving the last block in
+ * file and in the handle's position.
+ */
+static long cs1550_seek_chain(cs1550_handle *h, long index, cs1550_disk_block *file)
+{
+	cs1550_file_node *node = h->node;
+	long block;
+
+	if(cs1550_chain_load(node, index) < 0 || node->chain_len == 0)
+		return -EIO;
+
+	h->pos_index = index < node->chain_len ? index : node->chain_len - 1;
+	block = node->chain[h->pos_index];
+	h->pos_block = block;
+	if(cs1550_read_data_block(block, file) < 0)
+		return -EIO;
+	return h->pos_index == index ? block : 0;
+}
+
+//smallest readahead window, in blocks
+#define	RA_MIN 4
+
+/*
+ * Called with the range of chain indexes a read is about to copy; sets
+ * from and to to the indexes to fetch ahead, the same if there are none,
+ * going no further than limit. A read that picks up where the last one on
+ * this handle stopped opens a window of RA_MIN blocks, doubled each time it
+ * is refilled up to cs1550_ra_max; anything else closes it. Like the
+ * kernel, the next window is queued once the reader is within half a
+ * window of the end of what is already queued, so the prefetch runs ahead
+ * of the reads instead of behind them.
+ */
+static void cs1550_ra_window(cs1550_handle *h, long first, long last, long limit,
+		long *from, long *to)
+{
+	*from = *to = 0;
+	if(cs1550_ra_max == 0)
+		return;
+
+	//a read ending part way into a block leaves the next one starting in it
+	if(first != h->ra_expect && first != h->ra_expect - 1)
+	{
+		h->ra_window = 0;
+		h->ra_issued = 0;
+		h->ra_expect = last + 1;
+		return;
+	}
+
+	h->ra_expect = last + 1;
+	if(h->ra_window == 0)
+		h->ra_window = RA_MIN;
+	if(h->ra_issued < last + 1)
+		h->ra_issued = last + 1;
+	if(h->ra_issued - (last + 1) > h->ra_window / 2)
+		return;
+
+	*from = h->ra_issued;
+	*to = last + 1 + h->ra_window;
+	if(*to > limit)
+		*to = limit;
+	if(*to < *from)
+		*to = *from;
+	h->ra_issued = *to;
+
+	h->ra_window *= 2;
+	if(h->ra_window > cs1550_ra_max)
+		h->ra_window = cs1550_ra_max;
+}
+
+#ifdef CS1550_RA_THREAD
+//readahead into the buffer cache, for reads that copy out of it
+static void cs1550_readahead(cs1550_handle *h, long first, long last)
+{
+	cs1550_file_node *node = h->node;
+	long from, to, known;
+
+	cs1550_ra_window(h, first, last, cs1550_data_blocks(node->fsize), &from, &to);
+	if(from >= to)
+		return;
+
+	//what the vector already knows is queued by block, the rest is left
+	//to the thread to find by following the chain
+	known = to < node->chain_len ? to : node->chain_len;
+	if(from < known)
+		cs1550_prefetch(node->chain + from, known - from);
+	if(to > known && !node->chain_done && node->chain_len > 0)
+		cs1550_prefetch_chain(node->chain[node->chain_len - 1], to - node->chain_len);
+}
+#endif
+
+#if FUSE_VERSION >= 29
+/*
+ * Readahead for read_buf, which splices from .disk and never looks in the
+ * buffer cache: the kernel is asked to bring the window into its page cache
+ * instead, one call per stretch of consecutive blocks. Only the part of the
+ * chain the vector already holds can be asked for.
+ */
+static void cs1550_readahead_disk(cs1550_handle *h, long first, long last)
+{
+	cs1550_file_node *node = h->node;
+	long from, to, i, run;
+
+	cs1550_ra_window(h, first, last, node->chain_len, &from, &to);
+	for(i = from; i < to; i = run)
+	{
+		for(run = i + 1; run < to && node->chain[run] == node->chain[run - 1] + 1; run++)
+			;
+		posix_fadvise(cs1550_disk_fd, (off_t) node->chain[i] * BLOCK_SIZE,
+				(off_t) (run - i) * BLOCK_SIZE, POSIX_FADV_WILLNEED);
+	}
+}
+#endif
+
+//record a new size for the handle's file in its directory block and index
+static int cs1550_set_fsize(cs1550_handle *h, size_t fsize)
+{
+	h->node->fsize = fsize;
+	if(h->node->unlinked)
+		return 0;
+
+	//the file is in the directory, so the directory cannot go away; the
+	//root's slot array can move under a mkdir, so it is not looked in
+	cs1550_dir_node *d = h->node->dir;
+	cs1550_directory_entry *dir = cs1550_block_alloc();
+	long dir_block;
+	int ret = 0;
+
+	if(dir == NULL)
+		return -ENOMEM;
+	pthread_mutex_lock(&d->ent_lock);
+	dir_block = cs1550_slot_block(d, h->file_loc);
+	if(cs1550_read_block(dir_block, dir) < 0){
+		printf("problem reading the dir\n");
+		ret = -EIO;
+	}
+	else{
+		dir->files[h->file_loc % MAX_FILES_IN_DIR].fsize = fsize;
+		if(cs1550_write_block(dir_block, dir) < 0)
+			ret = -EIO;
+	}
+	pthread_mutex_unlock(&d->ent_lock);
+	free(dir);
+	return ret;
+}
+
+/*
+ * Extent-mapped files. On a version 2 image a new file's directory entry
+ * holds minus the block number of its first extent block instead of a data
+ * block. Its data lives in whole blocks with no link in them, described by
+ * runs of (first block, length) packed in order into a list of extent
+ * blocks. The runs are loaded into the file's index entry the first time
+ * they are needed, along with the file block each one starts at, so finding
+ * where an offset lives is a binary search and reads and writes go to .disk
+ * with one pread or pwrite per run. The data blocks of these files never
+ * pass through the buffer cache; their extent blocks do, like every other
+ * block of metadata.
+ */
+
+//is the file extent-mapped rather than a chain?
+static int cs1550_extent_mapped(const cs1550_file_node *node)
+{
+	return node->nStartBlock < 0;
+}
+
+//add a run to the end of the map as a run of its own
+static int cs1550_extent_append(struct cs1550_extent_map *m, long start, long len)
+{
+	if(m->n == m->cap)
+	{
+		long cap = m->cap > 0 ? m->cap * 2 : 16;
+		struct cs1550_extent *ext = realloc(m->ext, cap * sizeof(struct cs1550_extent));
+		long *first;
+
+		if(ext == NULL)
+			return -ENOMEM;
+		m->ext = ext;
+		first = realloc(m->first, cap * sizeof(long));
+		if(first == NULL)
+			return -ENOMEM;
+		m->first = first;
+		m->cap = cap;
+	}
+	m->ext[m->n].nStartBlock = start;
+	m->ext[m->n].nBlocks = len;
+	m->first[m->n] = m->nblocks;
+	m->nblocks += len;
+	m->n++;
+	return 0;
+}
+
+//add a run to the end of the map, merged into the last one if it carries on
+//from it
+static int cs1550_extent_push(struct cs1550_extent_map *m, long start, long len)
+{
+	struct cs1550_extent *last = m->n > 0 ? &m->ext[m->n - 1] : NULL;
+
+	if(last != NULL && last->nStartBlock + last->nBlocks == start)
+	{
+		last->nBlocks += len;
+		m->nblocks += len;
+		return 0;
+	}
+	return cs1550_extent_append(m, start, len);
+}
+
+//remember block as the next extent block of the map
+static int cs1550_extent_add_meta(struct cs1550_extent_map *m, long block)
+{
+	long *meta = realloc(m->meta, (m->nmeta + 1) * sizeof(long));
+
+	if(meta == NULL)
+		return -ENOMEM;
+	m->meta = meta;
+	m->meta[m->nmeta++] = block;
+	return 0;
+}
+
+/*
+ * Read the file's extent blocks into its map unless that has been done.
+ * Runs are kept as they are on disk, even ones that touch, so run i always
+ * belongs in entry i % MAX_EXTENTS_IN_BLOCK of extent block
+ * i / MAX_EXTENTS_IN_BLOCK.
+ */
+static int cs1550_extent_load(cs1550_file_node *node)
+{
+	struct cs1550_extent_map *m = &node->emap;
+	cs1550_extent_block *eb;
+	long block = -node->nStartBlock;
+	long i;
+	int ret = 0;
+
+	if(m->loaded)
+		return 0;
+	eb = cs1550_block_alloc();
+	if(eb == NULL)
+		return -ENOMEM;
+
+	m->n = m->nmeta = m->nblocks = 0;
+	while(ret == 0 && block > 0)
+	{
+		if(block >= cs1550_disk_blocks || m->nmeta >= cs1550_disk_blocks
+				|| cs1550_read_block(block, eb) < 0
+				|| eb->nExtents < 0 || eb->nExtents > MAX_EXTENTS_IN_BLOCK)
+		{
+			printf("bad extent block %ld\n", block);
+			ret = -EIO;
+			break;
+		}
+		if(cs1550_extent_add_meta(m, block) < 0)
+			ret = -ENOMEM;
+		for(i = 0; ret == 0 && i < eb->nExtents; i++)
+		{
+			struct cs1550_extent *e = &eb->extents[i];
+
+			if(e->nStartBlock <= 0 || e->nBlocks <= 0
+					|| e->nStartBlock + e->nBlocks > cs1550_disk_blocks)
+			{
+				printf("bad extent in block %ld\n", block);
+				ret = -EIO;
+			}
+			else if(cs1550_extent_append(m, e->nStartBlock, e->nBlocks) < 0)
+				ret = -ENOMEM;
+		}
+		block = eb->nNextBlock;
+	}
+	free(eb);
+	if(ret == 0)
+		m->loaded = 1;
+	return ret;
+}
+
+/*
+ * Write the runs from index from on back to the file's extent blocks,
+ * taking another extent block when the last one fills and giving back any
+ * that are left empty. The file always keeps its first one. On failure the
+ * extent blocks taken here are given back and the blocks on disk still
+ * describe the file as it was.
+ */
+static int cs1550_extent_save(cs1550_file_node *node, long from)
+{
+	struct cs1550_extent_map *m = &node->emap;
+	long need = m->n > 0 ? (m->n + MAX_EXTENTS_IN_BLOCK - 1) / MAX_EXTENTS_IN_BLOCK : 1;
+	long start = from / MAX_EXTENTS_IN_BLOCK;
+	long had = m->nmeta;
+	long b;
+	cs1550_extent_block *eb = NULL;
+	int ret = 0;
+
+	//a new block is linked in by the one before it, so that is rewritten too
+	if(start > m->nmeta - 1)
+		start = m->nmeta - 1;
+	if(start > need - 1)
+		start = need - 1;
+	if(start < 0)
+		start = 0;
+	while(ret == 0 && m->nmeta < need)
+	{
+		long block = cs1550_find_free_block();
+
+		if(block <= 0)
+			ret = -ENOSPC;
+		else if(cs1550_extent_add_meta(m, block) < 0)
+		{
+			cs1550_free_block(block);
+			ret = -ENOMEM;
+		}
+	}
+	if(ret == 0)
+	{
+		eb = cs1550_block_alloc();
+		if(eb == NULL)
+			ret = -ENOMEM;
+	}
+
+	//back to front, so no block is linked to before it is written
+	for(b = need - 1; ret == 0 && b >= start; b--)
+	{
+		long lo = b * MAX_EXTENTS_IN_BLOCK;
+		long count = m->n - lo < MAX_EXTENTS_IN_BLOCK ? m->n - lo : MAX_EXTENTS_IN_BLOCK;
+
+		memset(eb, 0, BLOCK_SIZE);
+		eb->nExtents = count > 0 ? count : 0;
+		eb->nNextBlock = b + 1 < need ? m->meta[b + 1] : 0;
+		memcpy(eb->extents, m->ext + lo, eb->nExtents * sizeof(struct cs1550_extent));
+		if(cs1550_write_block(m->meta[b], eb) < 0)
+			ret = -EIO;
+	}
+	free(eb);
+	if(ret < 0)
+	{
+		//nothing links to them until the first block rewritten is
+		while(m->nmeta > had)
+			cs1550_free_block(m->meta[--m->nmeta]);
+		return ret;
+	}
+
+	while(m->nmeta > need)
+		cs1550_free_block(m->meta[--m->nmeta]);
+	return 0;
+}
+
+//the disk block holding file block index, with the blocks of its run from
+//there on in *left; 0 if the map does not reach that far
+static long cs1550_extent_block_at(const struct cs1550_extent_map *m, long index,
+		long *left)
+{
+	long lo = 0, hi = m->n - 1;
+
+	if(index < 0 || index >= m->nblocks)
+		return 0;
+
+	//the last run that starts at or before index
+	while(lo < hi)
+	{
+		long mid = lo + (hi - lo + 1) / 2;
+
+		if(m->first[mid] <= index)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	*left = m->ext[lo].nBlocks - (index - m->first[lo]);
+	return m->ext[lo].nStartBlock + (index - m->first[lo]);
+}
+
+//take the last len blocks off the end of the map and free them. Only for
+//blocks that no extent block on disk lists yet
+static void cs1550_extent_unpush(struct cs1550_extent_map *m, long len)
+{
+	while(len > 0 && m->n > 0)
+	{
+		struct cs1550_extent *e = &m->ext[m->n - 1];
+		long cut = e->nBlocks < len ? e->nBlocks : len;
+
+		e->nBlocks -= cut;
+		m->nblocks -= cut;
+		len -= cut;
+		cs1550_free_run(e->nStartBlock + e->nBlocks, cut);
+		if(e->nBlocks == 0)
+			m->n--;
+	}
+}
+
+/*
+ * Map the file out to want blocks, as contiguously as the allocator can,
+ * and return how many blocks it covers afterwards. That is fewer than want
+ * only once the disk is full. When the new runs need another extent block
+ * and none is left, data blocks are given back from the end until one is.
+ */
+static long cs1550_extent_grow(cs1550_file_node *node, long want)
+{
+	struct cs1550_extent_map *m = &node->emap;
+	long need = want - m->nblocks;
+	long from = m->n > 0 ? m->n - 1 : 0;
+	long old = m->nblocks;
+	long *blocks, got, i, j;
+	int ret = 0;
+
+	if(need <= 0)
+		return m->nblocks;
+
+	blocks = malloc(need * sizeof(long));
+	if(blocks == NULL)
+		return -ENOMEM;
+	//right after the last run, or after the first extent block for the first
+	got = cs1550_alloc_blocks(m->n > 0 ? m->ext[m->n - 1].nStartBlock + m->ext[m->n - 1].nBlocks
+			: -node->nStartBlock + 1, need, blocks);
+
+	//the allocator hands blocks back in ascending runs
+	for(i = 0; i < got; i = j)
+	{
+		for(j = i + 1; j < got && blocks[j] == blocks[j - 1] + 1; j++)
+			;
+		//stale copies left in the cache by the blocks' last owner
+		cs1550_cache_discard(blocks[i], j - i);
+		if(cs1550_extent_push(m, blocks[i], j - i) < 0)
+		{
+			for(; i < got; i++)
+				cs1550_free_block(blocks[i]);
+			ret = -ENOMEM;
+			break;
+		}
+	}
+	free(blocks);
+
+	while(m->nblocks > old)
+	{
+		int err = cs1550_extent_save(node, from);
+
+		if(err == 0)
+			break;
+		if(err != -ENOSPC)
+		{
+			cs1550_extent_unpush(m, m->nblocks - old);
+			return err;
+		}
+		cs1550_extent_unpush(m, 1);
+	}
+	return ret < 0 ? ret : m->nblocks;
+}
+
+//copy size bytes at offset between buf and the file's blocks, a run at a
+//time, stopping where the map ends; returns how many were copied
+static int cs1550_extent_io(cs1550_file_node *node, char *buf, size_t size,
+		off_t offset, int writing)
+{
+	size_t count = 0;
+
+	while(count < size)
+	{
+		off_t pos = offset + count;
+		size_t byte;
+		long index = cs1550_block_pos(pos, &byte);
+		long left, block = cs1550_extent_block_at(&node->emap, index, &left);
+		size_t span;
+		ssize_t res;
+
+		if(block <= 0)
+			break;
+		span = left * BLOCK_SIZE - byte;
+		if(span > size - count)
+			span = size - count;
+
+		if(writing)
+			res = pwrite(cs1550_disk_fd, buf + count, span, (off_t) block * BLOCK_SIZE + byte);
+		else
+			res = pread(cs1550_disk_fd, buf + count, span, (off_t) block * BLOCK_SIZE + byte);
+		if(res <= 0)
+		{
+			printf("problem %s block %ld\n", writing ? "writing" : "reading", block);
+			return count > 0 ? (int) count : -EIO;
+		}
+		count += res;
+	}
+	return count;
+}
+
+//write_chain for an extent-mapped file
+static int cs1550_extent_write(cs1550_file_node *node, const char *buf, size_t size,
+		off_t offset)
+{
+	long have;
+
+	if(cs1550_extent_load(node) < 0)
+		return -EIO;
+	have = cs1550_extent_grow(node, cs1550_block_count(offset + size));
+	if(have < 0)
+		return have;
+
+	//out of space, keep what fits
+	if((off_t) have * BLOCK_SIZE < (off_t) (offset + size))
+		size = (off_t) have * BLOCK_SIZE > offset ? (off_t) have * BLOCK_SIZE - offset : 0;
+	if(size == 0)
+		return 0;
+	return cs1550_extent_io(node, (char *) buf, size, offset, 1);
+}
+
+//give back the blocks of an extent-mapped file past its first size bytes
+static int cs1550_extent_truncate(cs1550_file_node *node, off_t size)
+{
+	struct cs1550_extent_map *m = &node->emap;
+	long keep = cs1550_block_count(size);
+	long old_n, tail_start = 0, tail_len = 0, i;
+	int ret;
+
+	if(cs1550_extent_load(node) < 0)
+		return -EIO;
+	if(keep >= m->nblocks)
+		return 0;
+
+	old_n = m->n;
+	while(m->n > 0 && m->first[m->n - 1] >= keep)
+		m->n--;
+	if(m->n > 0 && m->first[m->n - 1] + m->ext[m->n - 1].nBlocks > keep)
+	{
+		struct cs1550_extent *e = &m->ext[m->n - 1];
+		long left = keep - m->first[m->n - 1];
+
+		tail_start = e->nStartBlock + left;
+		tail_len = e->nBlocks - left;
+		e->nBlocks = left;
+	}
+	m->nblocks = keep;
+
+	ret = cs1550_extent_save(node, m->n > 0 ? m->n - 1 : 0);
+	if(ret < 0)
+		return ret;
+
+	//the runs are only freed once nothing on disk points at them
+	if(tail_len > 0)
+		cs1550_free_run(tail_start, tail_len);
+	for(i = m->n; i < old_n; i++)
+		cs1550_free_run(m->ext[i].nStartBlock, m->ext[i].nBlocks);
+	return 0;
+}
+
+//free the extent blocks from block on and every run they list
+static int cs1550_extent_free_file(long block)
+{
+	cs1550_extent_block *eb = cs1550_block_alloc();
+	long i, seen = 0;
+	int ret = 0;
+
+	if(eb == NULL)
+		return -ENOMEM;
+	while(block > 0 && block < cs1550_disk_blocks && seen++ < cs1550_disk_blocks)
+	{
+		if(cs1550_read_block(block, eb) < 0)
+		{
+			ret = -EIO;
+			break;
+		}
+		for(i = 0; i < eb->nExtents && i < MAX_EXTENTS_IN_BLOCK; i++)
+			if(cs1550_free_run(eb->extents[i].nStartBlock, eb->extents[i].nBlocks) < 0)
+				ret = -EIO;
+		if(cs1550_free_block(block) < 0)
+			ret = -EIO;
+		block = eb->nNextBlock;
+	}
+	free(eb);
+	return ret;
+}
+
+//free every block of a file from its directory entry's nStartBlock
+static int cs1550_free_file(long nStartBlock)
+{
+	if(nStartBlock > 0)
+		return cs1550_mark_blocks_free(nStartBlock);
+	if(nStartBlock < 0)
+		return cs1550_extent_free_file(-nStartBlock);
+	return 0;
+}
+
+//write_chain for a linked file, with file to hold one block at a time
+static int cs1550_write_linked(cs1550_handle *h, cs1550_disk_block *file,
+		const char *buf, size_t size, off_t offset)
+{
+	cs1550_file_node *node = h->node;
+
+	//the vector has to reach the end of the chain before anything new can be
+	//appended to it
+	if(cs1550_chain_load(node, cs1550_data_pos(offset+size-1, NULL)) < 0)
+		return -EIO;
+
+	size_t byte_in_block;
+	long file_block = cs1550_seek_chain(h, cs1550_data_pos(offset, &byte_in_block), file);
+	if(file_block<0){
+		printf("problem reading disk block\n");
+		return -EIO;
+	}
+
+	if(file_block==0){
+		//appending right at a block boundary: start from the full last block
+		//so the loop below links a new tail onto it
+		file_block = h->pos_block;
+		byte_in_block = MAX_DATA_IN_BLOCK;
+	}
+
+	//blocks already in the chain are overwritten where they are; whatever the
+	//write needs past the end of the chain is allocated in one go, as
+	//contiguous as the disk allows
+	long *blocks = NULL;
+	long got = 0, next = 0;
+	size_t count = 0;
+	while(1){
+		size_t span = MAX_DATA_IN_BLOCK - byte_in_block;
+		if(span>size-count)
+			span = size-count;
+		memcpy(file->data+byte_in_block, buf+count, span);
+		count += span;
+
+		if(count<size && file->nNextBlock<=0 && blocks==NULL){
+			long need = cs1550_data_blocks(size-count);
+			blocks = malloc(need * sizeof(long));
+			if(blocks == NULL)
+				return -ENOMEM;
+			got = cs1550_alloc_blocks(file_block + 1, need, blocks);
+			if(got<=0){
+				//out of space, keep what made it
+				size = count;
+			}
+			else{
+				if(got<need)
+					size = count + got*MAX_DATA_IN_BLOCK;
+				file->nNextBlock = blocks[0];
+				if(cs1550_chain_append(node, blocks, got) < 0){
+					free(blocks);
+					return -ENOMEM;
+				}
+			}
+		}
+
+		if(cs1550_write_data_block(file_block, file) < 0){
+			free(blocks);
+			return -EIO;
+		}
+		if(count>=size)
+			break;
+
+		file_block = file->nNextBlock;
+		if(blocks!=NULL){
+			//a fresh block is fully overwritten except for the tail of the last one
+			next++;
+			file->nNextBlock = next<got ? blocks[next] : -1;
+			if(size-count<MAX_DATA_IN_BLOCK)
+				memset(file->data+(size-count), 0, MAX_DATA_IN_BLOCK-(size-count));
+		}
+		else if(size-count>=MAX_DATA_IN_BLOCK){
+			//about to be overwritten whole, so only its link is needed
+			file->nNextBlock = cs1550_fat_next(file_block);
+		}
+		else if(cs1550_read_data_block(file_block, file) < 0){
+			printf("problem reading disk block\n");
+			return -EIO;
+		}
+		h->pos_index++;
+		h->pos_block = file_block;
+		byte_in_block = 0;
+	}
+	free(blocks);
+
+	return count == 0 ? 0 : size;
+}
+
+/*
+ * Write size bytes at offset into the handle's chain, which must already
+ * reach offset, and return how many made it. The file's size is left to
+ * the caller.
+ */
+static int cs1550_write_chain(cs1550_handle *h, const char *buf, size_t size,
+		off_t offset)
+{
+	cs1550_disk_block *file;
+	int ret;
+
+	if(cs1550_extent_mapped(h->node))
+		return cs1550_extent_write(h->node, buf, size, offset);
+
+	file = cs1550_block_alloc();
+	if(file == NULL)
+		return -ENOMEM;
+	ret = cs1550_write_linked(h, file, buf, size, offset);
+	free(file);
+	return ret;
+}
+
+/*
+ * Write-behind. Small writes on an open file are gathered in a buffer hung
+ * off its index entry, so every handle on the file sees the same bytes, and
+ * only go down the chain when the buffer is flushed: on flush, fsync and
+ * release, before a read or truncate, when a write does not continue or
+ * overlap the buffered range, and when too many files hold a buffer at
+ * once. The directory entry's fsize is written once per flush. A file's
+ * buffer is guarded by its lock.
+ */
+
+//default write-behind buffer per file, overridden with -o writebehind_kb=N
+//(0 turns it off)
+#define	WB_DEFAULT_KB 64
+
+//files that may hold a buffer before all of them are flushed
+#define	WB_FILES 16
+
+static size_t cs1550_wb_max = 0;				//buffer size in bytes
+static long cs1550_wb_count = 0;				//buffers allocated
+static cs1550_file_node *cs1550_wb_list = NULL;	//files holding one
+static pthread_mutex_t cs1550_wb_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//forget the file's buffer without writing it
+static void cs1550_wb_drop(cs1550_file_node *node)
+{
+	cs1550_file_node **p = &cs1550_wb_list;
+
+	if(node->wb == NULL)
+		return;
+
+	pthread_mutex_lock(&cs1550_wb_lock);
+	while(*p != node)
+		p = &(*p)->wb_next;
+	*p = node->wb_next;
+	cs1550_wb_count--;
+	pthread_mutex_unlock(&cs1550_wb_lock);
+	free(node->wb);
+	node->wb = NULL;
+	node->wb_len = 0;
+}
+
+/*
+ * Write the file's buffered bytes through to its chain. With whole_blocks
+ * set, a partly filled last block stays behind in the buffer to be topped
+ * up by the writes that follow; otherwise the buffer is emptied and the
+ * new size is recorded in the directory entry.
+ */
+static int cs1550_wb_flush(cs1550_file_node *node, int whole_blocks)
+{
+	cs1550_handle h;
+	off_t end, cut;
+	size_t len;
+	int ret = 0;
+
+	if(node->wb == NULL)
+		return 0;
+
+	memset(&h, 0, sizeof(h));
+	h.dir_loc = node->dir_loc;
+	h.file_loc = node->slot;
+	h.node = node;
+
+	end = node->wb_off + node->wb_len;
+	cut = end;
+	if(whole_blocks)
+	{
+		size_t tail;
+
+		if(cs1550_extent_mapped(node))
+			tail = end & (BLOCK_SIZE - 1);
+		else
+			cs1550_data_pos(end, &tail);
+		cut = end - tail;
+	}
+	if(cut <= node->wb_off)
+		cut = end;
+	len = cut - node->wb_off;
+
+	if(len > 0)
+	{
+		ret = cs1550_write_chain(&h, node->wb, len, node->wb_off);
+		if(ret >= 0 && (size_t) ret < len)
+		{
+			//out of space: the file ends where the data stopped
+			size_t got = node->wb_off + ret;
+			node->fsize = got > node->wb_base ? got : node->wb_base;
+			ret = -ENOSPC;
+		}
+		else if(ret > 0)
+			ret = 0;
+	}
+
+	if(ret == 0 && cut < end)
+	{
+		memmove(node->wb, node->wb + len, end - cut);
+		node->wb_off = cut;
+		node->wb_len = end - cut;
+		return 0;
+	}
+
+	if(node->fsize != node->wb_base)
+	{
+		int err = cs1550_set_fsize(&h, node->fsize);
+		if(ret == 0)
+			ret = err;
+	}
+	cs1550_wb_drop(node);
+	return ret;
+}
+
+/*
+ * Flush every buffered file other than self. Called with self locked, so
+ * files are only taken if their lock is free; one that is busy is being
+ * written or flushed by its own thread anyway.
+ */
+static int cs1550_wb_flush_others(cs1550_file_node *self)
+{
+	cs1550_file_node *node;
+	int ret = 0;
+
+	while(1)
+	{
+		pthread_mutex_lock(&cs1550_wb_lock);
+		for(node = cs1550_wb_list; node != NULL; node = node->wb_next)
+			if(node != self && pthread_mutex_trylock(&node->lock) == 0)
+				break;
+		pthread_mutex_unlock(&cs1550_wb_lock);
+		if(node == NULL)
+			return ret;
+
+		//an emptying flush always takes the file off the list
+		if(cs1550_wb_flush(node, 0) < 0)
+			ret = -EIO;
+		pthread_mutex_unlock(&node->lock);
+	}
+}
+
+//take a write smaller than the buffer into it
+static int cs1550_wb_write(cs1550_file_node *node, const char *buf, size_t size,
+		off_t offset)
+{
+	int ret;
+
+	if(node->wb != NULL && offset + size > node->wb_off + cs1550_wb_max)
+	{
+		ret = cs1550_wb_flush(node, 1);
+		if(ret < 0)
+			return ret;
+	}
+	if(node->wb != NULL && (offset < node->wb_off
+			|| offset > node->wb_off + node->wb_len
+			|| offset + size > node->wb_off + cs1550_wb_max))
+	{
+		ret = cs1550_wb_flush(node, 0);
+		if(ret < 0)
+			return ret;
+	}
+
+	if(node->wb == NULL)
+	{
+		pthread_mutex_lock(&cs1550_wb_lock);
+		ret = cs1550_wb_count >= WB_FILES;
+		pthread_mutex_unlock(&cs1550_wb_lock);
+		if(ret)
+		{
+			ret = cs1550_wb_flush_others(node);
+			if(ret < 0)
+				return ret;
+		}
+		node->wb = malloc(cs1550_wb_max);
+		if(node->wb == NULL)
+			return -ENOMEM;
+		node->wb_off = offset;
+		node->wb_len = 0;
+		node->wb_base = node->fsize;
+		pthread_mutex_lock(&cs1550_wb_lock);
+		node->wb_next = cs1550_wb_list;
+		cs1550_wb_list = node;
+		cs1550_wb_count++;
+		pthread_mutex_unlock(&cs1550_wb_lock);
+	}
+
+	memcpy(node->wb + (offset - node->wb_off), buf, size);
+	if(offset + size > node->wb_off + node->wb_len)
+		node->wb_len = offset + size - node->wb_off;
+	if(offset + size > node->fsize)
+		node->fsize = offset + size;
+	return size;
+}
+
+/*
+ * Park a new handle on the file in fi. Called with the directory locked.
+ */
+static int cs1550_open_slot(int dir_loc, int file_loc, struct fuse_file_info *fi)
+{
+    /* We're not going to worry about permissions for this project, but 
+	   if we were and we don't have them to the file we should return an error
+
+        return -EACCES;
+    */
+
+	cs1550_handle *h = malloc(sizeof(cs1550_handle));
+	if(h == NULL)
+		return -ENOMEM;
+	cs1550_handle_init(h, dir_loc, file_loc);
+	pthread_mutex_lock(&h->node->lock);
+	h->node->open_count++;
+	//every change to the file goes through the kernel, so whatever it has
+	//cached from an earlier open is still right. The first open of a node
+	//drops the cache, as its inode number may have been another file's.
+	fi->keep_cache = h->node->opened;
+	h->node->opened = 1;
+	pthread_mutex_unlock(&h->node->lock);
+	fi->fh = (uint64_t) (uintptr_t) h;
+
+    return 0; //success!
+}
+
+/* End added functions */
+
+#ifndef CS1550_LOWLEVEL
+
+/*
+ * Called whenever the system wants to know the file attributes, including
+ * simply whether the file exists or not. 
+ *
+ * man -s 2 stat will show the fields of a stat structure
+ */
+static int cs1550_getattr_locked(const char *path, struct stat *stbuf)
+{
+	int res = 0;
+
+	memset(stbuf, 0, sizeof(struct stat));
+
+	char directory[MAX_FILENAME+1];
+	char filename[MAX_FILENAME+1];
+	char extension[MAX_EXTENSION+1];
+
+	//is path the root dir?
+	if (strcmp(path, "/") == 0)
+	{
+		cs1550_stat_dir(stbuf);
+		return 0;
+	}
+	else
+	{
+		if(cs1550_split_path(path, directory, filename, extension) < 0)
+			return -ENOENT;
+		int dir_loc = cs1550_find_dir_loc(directory);
+		// directory does not exist
+		if(dir_loc<0)
+			return -ENOENT;
+		//Check if name is subdirectory
+		if(filename[0]=='\0')
+		{
+			cs1550_stat_dir(stbuf);
+			return 0;
+		}
+		else
+		{
+			//we're looking for a file in directory which is indexed at dir_loc
+		 	size_t fsize = 0;
+			int file_loc = cs1550_find_file_loc(dir_loc, filename, extension, &fsize);
+			if(file_loc<0)
+				return -ENOENT;
+			cs1550_stat_file(stbuf, fsize);
+			return 0;
+		}
+		res = -ENOENT;
+	}
+	return res;
+}
+
+static int cs1550_getattr(const char *path, struct stat *stbuf)
+{
+	cs1550_dir_node *d = cs1550_lock_path(path, 0);
+	int ret = cs1550_getattr_locked(path, stbuf);
+
+	cs1550_unlock_path(d);
+	return ret;
+}
+
+/* 
+ * Called whenever the contents of a directory are desired. Could be from an 'ls'
+ * or could even be when a user hits TAB to do autocompletion
+ */
+static int cs1550_readdir_locked(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi)
+{
+	//Since we're building with -Wall (all warnings reported) we need
+	//to "use" every parameter, so let's just cast them to void to
+	//satisfy the compiler
+	(void) fi;
+
+	char directory[MAX_FILENAME+1];
+	char filename[MAX_FILENAME+1];
+	char extension[MAX_EXTENSION+1];
+	struct stat st;
+	off_t i;
+
+	//entries are numbered "." = 0, ".." = 1 and slot n = n + 2, and each is
+	//handed over with the number of the one after it, which is the offset
+	//the next call starts from once filler says the buffer is full. Their
+	//attributes come from the indexes so the kernel has them for free.
+	if (strcmp(path, "/") == 0)
+	{
+		for(i = offset; i < (off_t) cs1550_root_nslots + 2; i++)
+		{
+			const char *name = i == 0 ? "." : "..";
+
+			if(i >= 2)
+			{
+				if(cs1550_root_slots[i - 2] == NULL)
+					continue;
+				//this dir exists
+				name = cs1550_root_slots[i - 2]->dname;
+			}
+			cs1550_stat_dir(&st);
+			if(filler(buf, name, &st, i + 1))
+				break;
+		}
+		return 0;
+	}
+
+	if(cs1550_split_path(path, directory, filename, extension) < 0)
+		return -ENOENT;
+	int dir_loc = cs1550_find_dir_loc(directory);
+	if(dir_loc<0)
+	{
+		return -ENOENT;
+	}
+	cs1550_dir_node *d = cs1550_root_slots[dir_loc];
+	if(!d->files_loaded)
+	{
+		printf("error reading directory entry\n");
+		return -EIO;
+	}
+
+	for(i = offset; i < (off_t) d->nslots + 2; i++)
+	{
+		cs1550_file_node *node;
+		char file[MAX_FILENAME+MAX_EXTENSION+5];
+
+		if(i < 2)
+		{
+			strcpy(file, i == 0 ? "." : "..");
+			cs1550_stat_dir(&st);
+		}
+		else
+		{
+			node = d->file_slots[i - 2];
+			if(node == NULL)
+				continue;
+			strcpy(file, node->fname);
+			strcat(file, ".");
+			strcat(file, node->fext);
+			pthread_mutex_lock(&node->lock);
+			cs1550_stat_file(&st, node->fsize);
+			pthread_mutex_unlock(&node->lock);
+		}
+		if(filler(buf, file, &st, i + 1))
+			break;
+	}
+	return 0;
+}
+
+static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi)
+{
+	cs1550_dir_node *d = cs1550_lock_path(path, 0);
+	int ret = cs1550_readdir_locked(path, buf, filler, offset, fi);
+
+	cs1550_unlock_path(d);
+	return ret;
+}
+
+#endif /* CS1550_LOWLEVEL */
+
+/*
+ * Make directory in the root. Called with the root locked for writing;
+ * returns the root slot it went in.
+ */
+static int cs1550_mkdir_name(char *directory)
+{
+	 int ret = 0;
+	 int loc = cs1550_find_dir_loc(directory);
+	 if(loc>=0)
+	 {
+		 //it already exists
+		 //fclose(disk);
+		 printf("dir exists\n");
+		 return -EEXIST;
+	 }
+
+	 if(cs1550_root_hash == NULL)
+	 {
+		 printf("error reading root directory\n");
+		 return -EIO;
+	 }
+
+	 //first free slot, in a new root block if every block is full
+	 int i = cs1550_root_free_hint;
+	 while(i < cs1550_root_nslots && cs1550_root_slots[i] != NULL)
+		 i++;
+	 cs1550_root_free_hint = i;
+	 if(i >= cs1550_root_nslots)
+	 {
+		 ret = cs1550_root_grow();
+		 if(ret < 0)
+			 return ret;
+	 }
+
+	 long root_block = cs1550_root_slot_block(i);
+	 cs1550_root_directory *root = cs1550_block_alloc();
+	 if(root == NULL)
+		 return -ENOMEM;
+
+	 long block_loc = cs1550_find_free_block();
+	 if(block_loc <= 0)
+	 {
+		 free(root);
+		 printf("no free block for the directory\n");
+		 return -ENOSPC;
+	 }
+
+	 //the buffer is the empty directory block first, then the root block
+	 memset(root, 0, BLOCK_SIZE);
+	 if(cs1550_write_block(block_loc, root) < 0 ||
+	    cs1550_read_block(root_block, root) < 0)
+		 ret = -EIO;
+	 else
+	 {
+		 strcpy(root->directories[i % MAX_DIRS_IN_ROOT].dname,directory);
+		 root->directories[i % MAX_DIRS_IN_ROOT].nStartBlock = block_loc;
+		 root->nDirectories++;
+		 if(cs1550_write_block(root_block, root) < 0)
+			 ret = -EIO;
+	 }
+	 free(root);
+	 if(ret < 0)
+	 {
+		 printf("error writing the new directory\n");
+		 return ret;
+	 }
+
+	 ret = cs1550_root_index_add(directory, i, block_loc);
+	 if(ret < 0)
+		 return ret;
+	 cs1550_root_slots[i]->generation = cs1550_next_generation();
+	 return i;
+}
+
+#ifndef CS1550_LOWLEVEL
+
+/* 
+ * Creates a directory. We can ignore mode since we're not dealing with
+ * permissions, as long as getattr returns appropriate ones for us.
+ */
+static int cs1550_mkdir_locked(const char *path, mode_t mode)
+{
+	(void) mode;
+
+	char directory[MAX_FILENAME + 1];
+	char filename [MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1];
+
+	int ret = cs1550_split_path(path, directory, filename, extension);
+	if(ret < 0)
+		return ret;
+	//directories only go in the root
+	if(filename[0] != '\0')
+		return -EPERM;
+
+	ret = cs1550_mkdir_name(directory);
+	return ret < 0 ? ret : 0;
+}
+
+static int cs1550_mkdir(const char *path, mode_t mode)
+{
+	int ret;
+
+	pthread_rwlock_wrlock(&cs1550_root_lock);
+	ret = cs1550_mkdir_locked(path, mode);
+	pthread_rwlock_unlock(&cs1550_root_lock);
+	return ret;
+}
+
+#endif
+
+/*
+ * Remove the directory in root slot loc, which must be empty. Called with
+ * the root locked for writing.
+ */
+static int cs1550_rmdir_loc(int loc)
+{
+	cs1550_dir_node *d = cs1550_root_slots[loc];
+	if(cs1550_file_index_load(d) < 0)
+		return -EIO;
+	if(d->nfiles>0)
+		return -ENOTEMPTY;
+
+	long root_block = cs1550_root_slot_block(loc);
+	cs1550_root_directory *root = cs1550_block_alloc();
+	int ret = 0;
+	if(root == NULL)
+		return -ENOMEM;
+	if(cs1550_read_block(root_block, root) < 0)
+		ret = -EIO;
+	else{
+		memset(&root->directories[loc % MAX_DIRS_IN_ROOT], 0, sizeof(struct cs1550_directory));
+		root->nDirectories--;
+		if(cs1550_write_block(root_block, root) < 0)
+			ret = -EIO;
+	}
+	free(root);
+	if(ret < 0)
+		return ret;
+
+	//every block of the directory goes, not just the first
+	long i;
+	for(i = 0; i < d->nblocks; i++)
+		cs1550_free_block(d->blocks[i]);
+	cs1550_root_index_remove(loc);
+	return 0;
+}
+
+#ifndef CS1550_LOWLEVEL
+
+/* 
+ * Removes a directory.
+ */
+static int cs1550_rmdir_locked(const char *path)
+{
+	char directory[MAX_FILENAME + 1];
+	char filename [MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1];
+
+	if(cs1550_split_path(path, directory, filename, extension) < 0)
+		return -ENOENT;
+	if(filename[0]!='\0')
+		return -ENOTDIR;
+
+	int loc = cs1550_find_dir_loc(directory);
+	if(loc<0)
+		return -ENOENT;
+	return cs1550_rmdir_loc(loc);
+}
+
+//with the root locked for writing nobody else can be in the directory
+static int cs1550_rmdir(const char *path)
+{
+	int ret;
+
+	pthread_rwlock_wrlock(&cs1550_root_lock);
+	ret = cs1550_rmdir_locked(path);
+	pthread_rwlock_unlock(&cs1550_root_lock);
+	return ret;
+}
+
+#endif
+
+/*
+ * Make filename.extension in the directory in root slot loc. Called with
+ * the directory locked for writing and its ent_lock held; returns the slot
+ * the file went in.
+ */
+static int cs1550_mknod_in(int loc, char *filename, char *extension)
+{
+	int ret;
+	int file_loc = cs1550_find_file_loc(loc, filename, extension, NULL);
+	if(file_loc>=0){
+		return -EEXIST;
+	}
+
+	cs1550_dir_node *d = cs1550_root_slots[loc];
+	cs1550_directory_entry *dir;
+
+	if(!d->files_loaded){
+		printf("error reading directory entry\n");
+		return -EIO;
+	}
+
+	//first free slot, in a new block on the end if every block is full
+	int i = d->free_hint;
+	while(i < d->nslots && d->file_slots[i] != NULL)
+		i++;
+	d->free_hint = i;
+	if(i >= d->nslots){
+		ret = cs1550_dir_grow(d);
+		if(ret < 0)
+			return ret;
+	}
+
+	long dir_block = cs1550_slot_block(d, i);
+
+	dir = cs1550_block_alloc();
+	if(dir == NULL)
+		return -ENOMEM;
+	long block_loc = cs1550_find_free_block();
+	if(block_loc <= 0){
+		free(dir);
+		printf("no free block for the file\n");
+		return -ENOSPC;
+	}
+
+	//the buffer is the file's empty first block, then the directory block
+	cs1550_disk_block *file_block = (cs1550_disk_block *) dir;
+	memset(file_block, 0, BLOCK_SIZE);
+	if(!cs1550_extents)
+		file_block->nNextBlock = -1;
+	if((cs1550_extents ? cs1550_write_block(block_loc, file_block)
+			: cs1550_write_data_block(block_loc, file_block)) < 0){
+		printf("error writing the new file\n");
+		ret = -EIO;
+	}
+	else if(cs1550_read_block(dir_block, dir) < 0){
+		printf("error reading directory entry\n");
+		ret = -EIO;
+	}
+	else{
+		struct cs1550_file_directory *f = &dir->files[i % MAX_FILES_IN_DIR];
+		strcpy(f->fname, filename);
+		strcpy(f->fext , extension);
+		f->fsize = 0;
+		//on a version 2 image the block is the file's first extent block
+		f->nStartBlock = cs1550_extents ? -block_loc : block_loc;
+		dir->nFiles++;
+
+		if(cs1550_write_block(dir_block, dir) < 0){
+			printf("error writing the new file\n");
+			ret = -EIO;
+		}
+		else
+			ret = cs1550_file_index_add(d, i, f);
+	}
+	free(dir);
+	if(ret < 0)
+		return ret;
+	d->file_slots[i]->generation = cs1550_next_generation();
+	return i;
+}
+
+#ifndef CS1550_LOWLEVEL
+
+/* 
+ * Does the actual creation of a file. Mode and dev can be ignored.
+ *
+ */
+static int cs1550_mknod_locked(const char *path, mode_t mode, dev_t dev)
+{
+	(void) mode;
+	(void) dev;
+
+	char directory[MAX_FILENAME + 1];
+	char filename [MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1];
+
+	int ret = cs1550_split_path(path, directory, filename, extension);
+	if(ret < 0)
+		return ret;
+
+	if(filename[0]=='\0'){
+		printf("can't create in the root dir\n");
+		return -EPERM;
+	}
+
+	int loc = cs1550_find_dir_loc(directory);
+	if(loc<0){
+		printf("didn't find dir\n");
+		return -EPERM;
+	}
+
+	ret = cs1550_mknod_in(loc, filename, extension);
+	return ret < 0 ? ret : 0;
+}
+
+static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
+{
+	cs1550_dir_node *d = cs1550_lock_path(path, 1);
+	int ret;
+
+	if(d != NULL)
+		pthread_mutex_lock(&d->ent_lock);
+	ret = cs1550_mknod_locked(path, mode, dev);
+	if(d != NULL)
+		pthread_mutex_unlock(&d->ent_lock);
+	cs1550_unlock_path(d);
+	return ret;
+}
+
+#endif
+
+/*
+ * Remove filename.extension from the directory in root slot dir_loc.
+ * Called with the directory locked for writing.
+ */
+static int cs1550_unlink_in(int dir_loc, char *filename, char *extension)
+{
+	int file_loc = cs1550_find_file_loc(dir_loc, filename, extension, NULL);
+	if(file_loc<0)
+		return -ENOENT;
+
+	//the entry is cleared and ent_lock dropped before the file is locked,
+	//since size updates take ent_lock with the file's lock already held
+	cs1550_dir_node *d = cs1550_root_slots[dir_loc];
+	cs1550_directory_entry *dir = cs1550_block_alloc();
+	long file_block = 0;
+	int ret = 0;
+
+	long dir_block;
+
+	if(dir == NULL)
+		return -ENOMEM;
+	pthread_mutex_lock(&d->ent_lock);
+	dir_block = cs1550_slot_block(d, file_loc);
+	if(cs1550_read_block(dir_block, dir) < 0)
+		ret = -EIO;
+	else{
+		file_block = dir->files[file_loc % MAX_FILES_IN_DIR].nStartBlock;
+		memset(&dir->files[file_loc % MAX_FILES_IN_DIR], 0, sizeof(struct cs1550_file_directory));
+		dir->nFiles--;
+		if(cs1550_write_block(dir_block, dir) < 0)
+			ret = -EIO;
+	}
+	pthread_mutex_unlock(&d->ent_lock);
+	free(dir);
+	if(ret < 0)
+		return ret;
+
+	//an open file outlives its directory entry until the last release
+	cs1550_file_node *node = cs1550_file_at(dir_loc, file_loc);
+	pthread_mutex_lock(&node->lock);
+	int still_open = node->open_count > 0;
+	cs1550_file_index_remove(d, file_loc);
+	pthread_mutex_unlock(&node->lock);
+	if(!still_open){
+		cs1550_free_file(file_block);
+		cs1550_file_node_free(node);
+	}
+	return 0;
+}
+
+#ifndef CS1550_LOWLEVEL
+
+/*
+ * Deletes a file
+ */
+static int cs1550_unlink_locked(const char *path)
+{
+	char directory[MAX_FILENAME + 1];
+	char filename [MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1];
+
+	if(cs1550_split_path(path, directory, filename, extension) < 0)
+		return -ENOENT;
+
+	int dir_loc = cs1550_find_dir_loc(directory);
+	if(dir_loc<0)
+		return -ENOENT;
+	if(filename[0]=='\0')
+		return -EISDIR;
+	return cs1550_unlink_in(dir_loc, filename, extension);
+}
+
+static int cs1550_unlink(const char *path)
+{
+	cs1550_dir_node *d = cs1550_lock_path(path, 1);
+	int ret = cs1550_unlink_locked(path);
+
+	cs1550_unlock_path(d);
+	return ret;
+}
+
+#endif
+
+//the low-level build reads through cs1550_read_buf when it has it
+#if !defined(CS1550_LOWLEVEL) || FUSE_VERSION < 29
+/* 
+ * Read size bytes from file into buf starting from offset
+ *
+ */
+static int cs1550_read_locked(cs1550_handle *h, char *buf, size_t size, off_t offset)
+{
+	int ret = cs1550_wb_flush(h->node, 0);
+
+	if(ret < 0)
+		return ret;
+
+	size_t fsize = h->node->fsize;
+	if(offset>fsize){
+		printf("offset is bigger than filesize\n");
+		return -EFBIG;
+	}
+	if(offset==fsize)
+		return 0;
+
+	if(size>fsize-offset)
+		size = fsize-offset;
+
+	if(cs1550_extent_mapped(h->node)){
+		if(cs1550_extent_load(h->node) < 0)
+			return -EIO;
+		return cs1550_extent_io(h->node, buf, size, offset, 0);
+	}
+
+	size_t byte_in_block;
+	long first = cs1550_data_pos(offset, &byte_in_block);
+	long last = cs1550_data_pos(offset+size-1, NULL);
+
+	if(cs1550_chain_load(h->node, last) < 0)
+		return -EIO;
+	cs1550_readahead(h, first, last);
+
+	cs1550_disk_block *file = cs1550_block_alloc();
+	if(file == NULL)
+		return -ENOMEM;
+	long file_block = cs1550_seek_chain(h, first, file);
+	if(file_block<0){
+		printf("problem reading disk block\n");
+		ret = -EIO;
+	}
+
+	//copy the rest of each block in one go; only the first block starts
+	//part way in and only the last one stops short. A file_block of 0
+	//means offset is exactly the end of the last block
+	size_t count = 0;
+	while(file_block>0){
+		size_t span = MAX_DATA_IN_BLOCK - byte_in_block;
+		if(span>size-count)
+			span = size-count;
+		memcpy(buf+count, file->data+byte_in_block, span);
+		count += span;
+		if(count>=size)
+			break;
+
+		//next block
+		if(h->pos_index+1>=h->node->chain_len)
+			break;
+		file_block = h->node->chain[++h->pos_index];
+		if(cs1550_read_data_block(file_block, file) < 0){
+			printf("problem reading disk block\n");
+			ret = -EIO;
+			break;
+		}
+		h->pos_block = file_block;
+		byte_in_block = 0;
+	}
+	free(file);
+
+	return ret < 0 ? ret : (int) count;
+}
+
+static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
+			  struct fuse_file_info *fi)
+{
+	cs1550_handle tmp, *h;
+	int ret;
+
+	if(size<=0){
+		printf("size = %zu\n",size);
+		return -1;
+	}
+
+	ret = cs1550_get_handle(path, fi, &tmp, &h);
+	if(ret < 0)
+		return ret;
+	ret = cs1550_read_locked(h, buf, size, offset);
+	cs1550_put_handle(h);
+	return ret;
+}
+#endif
+
+/* 
+ * Write size bytes from buf into file starting from offset
+ *
+ */
+static int cs1550_write_locked(cs1550_handle *h, const char *buf, size_t size,
+			  off_t offset)
+{
+	cs1550_file_node *node = h->node;
+	int ret;
+
+	if(offset>node->fsize){
+		printf("offset is bigger than filesize\n");
+		return -EFBIG;
+	}
+
+	//small writes on an open file are gathered up and written out later
+	if(!h->path_locked && size < cs1550_wb_max)
+		return cs1550_wb_write(node, buf, size, offset);
+
+	ret = cs1550_wb_flush(node, 0);
+	if(ret < 0)
+		return ret;
+
+	ret = cs1550_write_chain(h, buf, size, offset);
+	if(ret <= 0)
+		return ret == 0 ? -ENOSPC : ret;
+	if(offset+ret>node->fsize){
+		int err = cs1550_set_fsize(h, offset+ret);
+		if(err < 0)
+			return err;
+	}
+
+	return ret;
+}
+
+static int cs1550_write(const char *path, const char *buf, size_t size, 
+			  off_t offset, struct fuse_file_info *fi)
+{
+	cs1550_handle tmp, *h;
+	int ret;
+
+	if(size<=0){
+		printf("size = %zu\n",size);
+		return -1;
+	}
+
+	ret = cs1550_get_handle(path, fi, &tmp, &h);
+	if(ret < 0)
+		return ret;
+	ret = cs1550_write_locked(h, buf, size, offset);
+	cs1550_put_handle(h);
+	return ret;
+}
+
+#if FUSE_VERSION >= 29
+
+/*
+ * Zero-copy reads and writes for FUSE 2.9 and later. Instead of copying a
+ * read into a buffer, read_buf hands back one fuse_buf per block pointing at
+ * the data part of that block in .disk, and FUSE splices it straight to the
+ * kernel. Dirty cached copies are written back first so .disk is current.
+ *
+ * FUSE reads the descriptor after we have returned and dropped the file's
+ * lock, so a racing write can land on either side of it, as it could with
+ * a plain read that came in just before or after.
+ */
+
+//read_buf for an extent-mapped file: one fuse_buf for each run the range
+//covers, since the blocks of a run sit end to end in .disk
+static int cs1550_extent_read_buf(cs1550_file_node *node, struct fuse_bufvec **bufp,
+		size_t size, off_t offset)
+{
+	struct fuse_bufvec *bv;
+	size_t count = 0;
+	long cap = 1;
+
+	if(cs1550_extent_load(node) < 0)
+		return -EIO;
+
+	bv = malloc(sizeof(struct fuse_bufvec));
+	if(bv == NULL)
+		return -ENOMEM;
+	*bv = FUSE_BUFVEC_INIT(0);
+	bv->count = 0;
+
+	while(count < size)
+	{
+		off_t pos = offset + count;
+		size_t byte;
+		long index = cs1550_block_pos(pos, &byte);
+		long left, block = cs1550_extent_block_at(&node->emap, index, &left);
+		struct fuse_buf *b;
+
+		if(block <= 0)
+			break;
+		if((long) bv->count == cap)
+		{
+			struct fuse_bufvec *more = realloc(bv, sizeof(struct fuse_bufvec) +
+					(2 * cap - 1) * sizeof(struct fuse_buf));
+			if(more == NULL)
+			{
+				free(bv);
+				return -ENOMEM;
+			}
+			bv = more;
+			cap *= 2;
+		}
+
+		b = &bv->buf[bv->count++];
+		b->size = left * BLOCK_SIZE - byte;
+		if(b->size > size - count)
+			b->size = size - count;
+		b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		b->mem = NULL;
+		b->fd = cs1550_disk_fd;
+		b->pos = (off_t) block * BLOCK_SIZE + byte;
+		count += b->size;
+	}
+	//an empty read still hands back the empty buffer
+	if(bv->count == 0)
+		bv->count = 1;
+
+	*bufp = bv;
+	return 0;
+}
+
+static int cs1550_read_buf_locked(cs1550_handle *h, struct fuse_bufvec **bufp,
+		size_t size, off_t offset)
+{
+	cs1550_file_node *node = h->node;
+	struct fuse_bufvec *bv;
+	long first, last, i;
+	size_t byte_in_block, count = 0;
+	int ret = cs1550_wb_flush(node, 0);
+
+	if(ret < 0)
+		return ret;
+
+	size_t fsize = node->fsize;
+	if(offset>fsize){
+		printf("offset is bigger than filesize\n");
+		return -EFBIG;
+	}
+	if(size>fsize-offset)
+		size = fsize-offset;
+
+	if(cs1550_extent_mapped(node))
+		return cs1550_extent_read_buf(node, bufp, size, offset);
+
+	first = cs1550_data_pos(offset, &byte_in_block);
+	last = size == 0 ? first - 1 : cs1550_data_pos(offset+size-1, NULL);
+	if(last >= first)
+	{
+		if(cs1550_chain_load(node, last) < 0)
+			return -EIO;
+		//offset is exactly the end of the last block
+		if(last >= node->chain_len)
+			last = node->chain_len - 1;
+	}
+	if(last >= first)
+	{
+		cs1550_readahead_disk(h, first, last);
+		if(cs1550_cache_sync(node->chain + first, last - first + 1) < 0)
+			return -EIO;
+	}
+
+	bv = malloc(sizeof(struct fuse_bufvec) +
+			(last > first ? last - first : 0) * sizeof(struct fuse_buf));
+	if(bv == NULL)
+		return -ENOMEM;
+	*bv = FUSE_BUFVEC_INIT(0);
+	bv->count = last >= first ? last - first + 1 : 1;
+
+	for(i = first; i <= last; i++)
+	{
+		struct fuse_buf *b = &bv->buf[i - first];
+		size_t span = MAX_DATA_IN_BLOCK - byte_in_block;
+
+		if(span>size-count)
+			span = size-count;
+		b->size = span;
+		b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		b->mem = NULL;
+		b->fd = cs1550_disk_fd;
+		b->pos = (off_t) node->chain[i] * BLOCK_SIZE +
+				offsetof(cs1550_disk_block, data) + byte_in_block;
+		count += span;
+		byte_in_block = 0;
+	}
+	if(last >= first)
+	{
+		h->pos_index = last;
+		h->pos_block = node->chain[last];
+	}
+
+	*bufp = bv;
+	return 0;
+}
+
+static int cs1550_read_buf(const char *path, struct fuse_bufvec **bufp,
+		size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	cs1550_handle tmp, *h;
+	int ret;
+
+	if(size<=0){
+		printf("size = %zu\n",size);
+		return -1;
+	}
+
+	ret = cs1550_get_handle(path, fi, &tmp, &h);
+	if(ret < 0)
+		return ret;
+	ret = cs1550_read_buf_locked(h, bufp, size, offset);
+	cs1550_put_handle(h);
+	return ret;
+}
+
+//pull the whole of src into memory and write it the ordinary way
+static int cs1550_write_buf_copy(cs1550_handle *h, struct fuse_bufvec *src,
+		size_t size, off_t offset)
+{
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	ssize_t res;
+	int ret;
+
+	dst.buf[0].mem = malloc(size);
+	if(dst.buf[0].mem == NULL)
+		return -ENOMEM;
+	res = fuse_buf_copy(&dst, src, 0);
+	if(res < 0)
+		ret = res;
+	else if(res == 0)
+		ret = 0;
+	else
+		ret = cs1550_write_locked(h, dst.buf[0].mem, res, offset);
+	free(dst.buf[0].mem);
+	return ret;
+}
+
+/*
+ * Write src at offset. A large write on an open file that only overwrites
+ * blocks the file already has is spliced from FUSE straight into the data
+ * part of each block in .disk, except for blocks the cache holds, which
+ * take the bytes in memory instead so the cache stays authoritative. Cached
+ * copies that turn up while a block is being written directly are dropped
+ * afterwards. Anything that needs blocks allocated, and small writes, which
+ * go to the write-behind buffer, are copied in and written as usual.
+ */
+
+//write_buf for an extent-mapped file whose blocks already reach offset +
+//size: spliced a run at a time, as none of its blocks are cached
+static int cs1550_extent_write_buf(cs1550_handle *h, struct fuse_bufvec *src,
+		size_t size, off_t offset)
+{
+	cs1550_file_node *node = h->node;
+	size_t count = 0;
+	int ret = cs1550_wb_flush(node, 0);
+
+	if(ret < 0)
+		return ret;
+
+	while(count < size)
+	{
+		off_t pos = offset + count;
+		size_t byte;
+		long index = cs1550_block_pos(pos, &byte);
+		long left, block = cs1550_extent_block_at(&node->emap, index, &left);
+		size_t span;
+		struct fuse_bufvec dst = FUSE_BUFVEC_INIT(0);
+		ssize_t res;
+
+		if(block <= 0)
+			break;
+		span = left * BLOCK_SIZE - byte;
+		if(span>size-count)
+			span = size-count;
+		dst.buf[0].size = span;
+		dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		dst.buf[0].fd = cs1550_disk_fd;
+		dst.buf[0].pos = (off_t) block * BLOCK_SIZE + byte;
+		res = fuse_buf_copy(&dst, src, FUSE_BUF_SPLICE_NONBLOCK);
+		if(res < 0)
+		{
+			if(count == 0)
+				return res;
+			break;
+		}
+		count += res;
+		if((size_t) res < span)
+			break;
+	}
+
+	if(count == 0)
+		return 0;
+	if(offset+count>node->fsize){
+		ret = cs1550_set_fsize(h, offset+count);
+		if(ret < 0)
+			return ret;
+	}
+	return count;
+}
+
+static int cs1550_write_buf_locked(cs1550_handle *h, struct fuse_bufvec *src,
+		off_t offset)
+{
+	cs1550_file_node *node = h->node;
+	size_t size = fuse_buf_size(src);
+	size_t byte_in_block, count = 0;
+	long first, last, i;
+	int ret;
+
+	if(offset>node->fsize){
+		printf("offset is bigger than filesize\n");
+		return -EFBIG;
+	}
+	if(size == 0)
+		return 0;
+
+	first = cs1550_data_pos(offset, &byte_in_block);
+	last = cs1550_data_pos(offset+size-1, NULL);
+	if(h->path_locked || size < cs1550_wb_max)
+		return cs1550_write_buf_copy(h, src, size, offset);
+	if(cs1550_extent_mapped(node))
+	{
+		if(cs1550_extent_load(node) < 0)
+			return -EIO;
+		if((off_t) (offset + size) > (off_t) node->emap.nblocks * BLOCK_SIZE)
+			return cs1550_write_buf_copy(h, src, size, offset);
+		return cs1550_extent_write_buf(h, src, size, offset);
+	}
+	if(cs1550_chain_load(node, last) < 0)
+		return -EIO;
+	if(last >= node->chain_len)
+		return cs1550_write_buf_copy(h, src, size, offset);
+
+	ret = cs1550_wb_flush(node, 0);
+	if(ret < 0)
+		return ret;
+
+	for(i = first; i <= last; i++)
+	{
+		long block = node->chain[i];
+		size_t span = MAX_DATA_IN_BLOCK - byte_in_block;
+		struct fuse_bufvec dst = FUSE_BUFVEC_INIT(0);
+		ssize_t res;
+		cs1550_buf *b;
+
+		if(span>size-count)
+			span = size-count;
+		dst.buf[0].size = span;
+
+		pthread_mutex_lock(&cs1550_cache_lock);
+		b = cs1550_cache_peek(block);
+		if(b != NULL)
+		{
+			//busy keeps readers off the buffer while the lock is dropped
+			b->busy = 1;
+			pthread_mutex_unlock(&cs1550_cache_lock);
+			dst.buf[0].mem = b->data + offsetof(cs1550_disk_block, data) + byte_in_block;
+			res = fuse_buf_copy(&dst, src, 0);
+			pthread_mutex_lock(&cs1550_cache_lock);
+			b->busy = 0;
+			if(res > 0)
+				b->dirty = 1;
+			pthread_cond_broadcast(&cs1550_cache_io_done);
+			pthread_mutex_unlock(&cs1550_cache_lock);
+		}
+		else
+		{
+			pthread_mutex_unlock(&cs1550_cache_lock);
+			dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+			dst.buf[0].fd = cs1550_disk_fd;
+			dst.buf[0].pos = (off_t) block * BLOCK_SIZE +
+					offsetof(cs1550_disk_block, data) + byte_in_block;
+			res = fuse_buf_copy(&dst, src, FUSE_BUF_SPLICE_NONBLOCK);
+			cs1550_cache_forget(block);
+		}
+
+		if(res < 0)
+		{
+			if(count == 0)
+				return res;
+			break;
+		}
+		count += res;
+		h->pos_index = i;
+		h->pos_block = block;
+		if((size_t) res < span || count >= size)
+			break;
+		byte_in_block = 0;
+	}
+
+	if(count == 0)
+		return 0;
+	if(offset+count>node->fsize){
+		ret = cs1550_set_fsize(h, offset+count);
+		if(ret < 0)
+			return ret;
+	}
+	return count;
+}
+
+static int cs1550_write_buf(const char *path, struct fuse_bufvec *buf,
+		off_t offset, struct fuse_file_info *fi)
+{
+	cs1550_handle tmp, *h;
+	int ret;
+
+	ret = cs1550_get_handle(path, fi, &tmp, &h);
+	if(ret < 0)
+		return ret;
+	ret = cs1550_write_buf_locked(h, buf, offset);
+	cs1550_put_handle(h);
+	return ret;
+}
+
+#endif /* FUSE_VERSION >= 29 */
+
+/*
+ * truncate is called when a new file is created (with a 0 size) or when an
+ * existing file is made shorter, most often by open with O_TRUNC. Since
+ * write overwrites in place, this is what drops the old contents. Blocks
+ * past the new end are freed; the first block always stays.
+ *
+ */
+static int cs1550_truncate_locked(cs1550_handle *h, off_t size)
+{
+	int ret = cs1550_wb_flush(h->node, 0);
+
+	if(ret < 0)
+		return ret;
+
+	if((size_t) size > h->node->fsize)
+	{
+		//grow by writing zeros at the end, recording the size once
+		char zeros[4096];
+		size_t end = h->node->fsize;
+
+		memset(zeros, 0, sizeof(zeros));
+		while((size_t) size > end)
+		{
+			size_t len = size - end;
+			if(len > sizeof(zeros))
+				len = sizeof(zeros);
+			ret = cs1550_write_chain(h, zeros, len, end);
+			if(ret <= 0)
+				break;
+			end += ret;
+		}
+		if(end != h->node->fsize)
+		{
+			int err = cs1550_set_fsize(h, end);
+			if(err < 0)
+				return err;
+		}
+		if(ret <= 0)
+			return ret == 0 ? -ENOSPC : ret;
+		return 0;
+	}
+
+	if(cs1550_extent_mapped(h->node))
+	{
+		ret = cs1550_extent_truncate(h->node, size);
+		if(ret < 0)
+			return ret;
+		return cs1550_set_fsize(h, size);
+	}
+
+	cs1550_disk_block *file = cs1550_block_alloc();
+	long keep = size > 0 ? cs1550_data_pos(size - 1, NULL) : 0;
+	long last;
+
+	if(file == NULL)
+		return -ENOMEM;
+	last = cs1550_seek_chain(h, keep, file);
+	if(last <= 0)
+		ret = -EIO;
+	else if(file->nNextBlock > 0)
+	{
+		cs1550_mark_blocks_free(file->nNextBlock);
+		file->nNextBlock = -1;
+		if(cs1550_write_data_block(last, file) < 0)
+			ret = -EIO;
+		else
+		{
+			h->node->chain_len = keep + 1;
+			h->node->chain_done = 1;
+		}
+	}
+	free(file);
+	if(ret < 0)
+		return ret;
+
+	return cs1550_set_fsize(h, size);
+}
+
+#ifndef CS1550_LOWLEVEL
+
+static int cs1550_truncate(const char *path, off_t size)
+{
+	cs1550_handle tmp, *h;
+	int ret;
+
+	if(size < 0)
+		return -EINVAL;
+	ret = cs1550_get_handle(path, NULL, &tmp, &h);
+	if(ret < 0)
+		return ret;
+	ret = cs1550_truncate_locked(h, size);
+	cs1550_put_handle(h);
+	return ret;
+}
+
+
+/* 
+ * Called when we open a file
+ *
+ */
+static int cs1550_open(const char *path, struct fuse_file_info *fi)
+{
+	int dir_loc, file_loc;
+	cs1550_dir_node *d = cs1550_lock_path(path, 0);
+	int ret = cs1550_resolve(path, &dir_loc, &file_loc);
+
+	//if we can't find the desired file, return an error
+	if(ret == 0)
+		ret = cs1550_open_slot(dir_loc, file_loc, fi);
+	cs1550_unlock_path(d);
+	return ret;
+}
+
+/*
+ * Called for open(2) with O_CREAT on a file that does not exist yet.
+ */
+static int cs1550_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	int ret = cs1550_mknod(path, mode, 0);
+
+	if(ret < 0)
+		return ret;
+	return cs1550_open(path, fi);
+}
+
+#endif
+
+/*
+ * Called when the last descriptor sharing an open is closed.
+ */
+static int cs1550_release(const char *path, struct fuse_file_info *fi)
+{
+	(void) path;
+
+	cs1550_handle *h = (cs1550_handle *) (uintptr_t) fi->fh;
+	if(h == NULL)
+		return 0;
+
+	cs1550_file_node *node = h->node;
+	int gone = 0;
+
+	pthread_mutex_lock(&node->lock);
+	node->open_count--;
+	if(!node->unlinked)
+		cs1550_wb_flush(node, 0);
+	else if(node->open_count == 0)
+	{
+		cs1550_wb_drop(node);
+		cs1550_free_file(node->nStartBlock);
+		gone = 1;
+	}
+	pthread_mutex_unlock(&node->lock);
+	if(gone)
+		cs1550_file_node_free(node);
+
+	free(h);
+	fi->fh = 0;
+	return 0;
+}
+
+/*
+ * Called when close is called on a file descriptor, but because it might
+ * have been dup'ed, this isn't a guarantee we won't ever need the file 
+ * again. The file's write-behind buffer and then the dirty cached blocks
+ * are written back so a closed file is on .disk.
+ */
+static int cs1550_flush (const char *path , struct fuse_file_info *fi)
+{
+	(void) path;
+
+	if(fi != NULL && fi->fh != 0)
+	{
+		cs1550_handle *h = (cs1550_handle *) (uintptr_t) fi->fh;
+		pthread_mutex_lock(&h->node->lock);
+		int ret = cs1550_wb_flush(h->node, 0);
+		pthread_mutex_unlock(&h->node->lock);
+		if(ret < 0)
+			return ret;
+	}
+	return cs1550_cache_flush();
+}
+
+/*
+ * Called on fsync(2). Writes back what flush does and then makes .disk
+ * itself durable.
+ */
+static int cs1550_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	(void) path;
+
+	int ret = cs1550_flush(path, fi);
+	if(ret < 0)
+		return ret;
+
+	if(datasync)
+		ret = fdatasync(cs1550_disk_fd);
+	else
+		ret = fsync(cs1550_disk_fd);
+	return ret < 0 ? -errno : 0;
+}
+
+//default for -o cache_timeout=N. Nothing but this mount changes .disk while
+//it is mounted, so the kernel can keep what we tell it for a long time.
+#define	KERNEL_CACHE_TIMEOUT 60
+
+//our own -o options; everything else is passed through to FUSE
+struct cs1550_options
+{
+	unsigned long cache_kb;		//buffer cache budget in KiB
+	unsigned long readahead_kb;	//largest readahead window in KiB
+	unsigned long writebehind_kb;	//write-behind buffer per file in KiB
+	unsigned long cache_timeout;	//seconds the kernel may trust names and attributes
+	unsigned long block_size;	//block size for an image that gets formatted
+	int extents;				//make new files extent-mapped
+};
+
+static struct cs1550_options cs1550_opts = {
+	.cache_kb = CACHE_DEFAULT_KB,
+	.readahead_kb = RA_DEFAULT_KB,
+	.writebehind_kb = WB_DEFAULT_KB,
+	.cache_timeout = KERNEL_CACHE_TIMEOUT,
+	.block_size = MIN_BLOCK_SIZE,
+};
+
+#define	CS1550_OPT(t, p) { t, offsetof(struct cs1550_options, p), 0 }
+
+static const struct fuse_opt cs1550_fuse_opts[] = {
+	CS1550_OPT("cache_kb=%lu", cache_kb),
+	CS1550_OPT("readahead_kb=%lu", readahead_kb),
+	CS1550_OPT("writebehind_kb=%lu", writebehind_kb),
+	CS1550_OPT("cache_timeout=%lu", cache_timeout),
+	CS1550_OPT("block_size=%lu", block_size),
+	{ "extents", offsetof(struct cs1550_options, extents), 1 },
+	FUSE_OPT_END
+};
+
+/*
+ * Build the in-memory indexes from .disk. Done before fuse_main, so an
+ * image they can't be built for stops the mount instead of leaving the
+ * operations to trip over a missing table; .disk is closed again then.
+ */
+static int cs1550_load(void)
+{
+	int ret = -1;
+
+	if(cs1550_bitmap_load() < 0)
+		printf("could not load the bitmap\n");
+	else if(cs1550_holes_build() < 0)
+		printf("could not index the free space\n");
+	else if(cs1550_fat_init() < 0)
+		printf("could not allocate the block table\n");
+	else if(cs1550_root_index_load() < 0)
+		printf("could not index the root directory\n");
+	else
+		ret = 0;
+
+	if(ret < 0)
+	{
+		cs1550_root_index_free();
+		cs1550_holes_free();
+		cs1550_bitmap_free();
+		cs1550_fat_free();
+		cs1550_disk_close();
+	}
+	return ret;
+}
+
+/*
+ * Called once the file system is mounted, before any other operation.
+ * Starts the readahead thread, which would not survive the fork into the
+ * background if it were started any earlier.
+ */
+static void *cs1550_init(struct fuse_conn_info *conn)
+{
+#if FUSE_VERSION >= 29
+	//let read_buf and write_buf splice; -o no_splice_read/no_splice_write
+	//still turn it off
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE);
+#else
+	(void) conn;
+#endif
+
+	cs1550_ra_start(cs1550_opts.readahead_kb);
+	cs1550_wb_max = cs1550_opts.writebehind_kb * 1024;
+	return NULL;
+}
+
+/*
+ * Called on unmount, after the last operation. Puts .disk away.
+ */
+static void cs1550_destroy(void *data)
+{
+	(void) data;
+
+	cs1550_wb_flush_others(NULL);
+	cs1550_ra_stop();
+	cs1550_root_index_free();
+	cs1550_holes_free();
+	cs1550_bitmap_free();
+	cs1550_fat_free();
+	cs1550_disk_close();
+}
+
+
+#ifndef CS1550_LOWLEVEL
+
+//register our new functions as the implementations of the syscalls
+static struct fuse_operations hello_oper = {
+    .getattr	= cs1550_getattr,
+    .readdir	= cs1550_readdir,
+    .mkdir	= cs1550_mkdir,
+	.rmdir = cs1550_rmdir,
+    .read	= cs1550_read,
+    .write	= cs1550_write,
+#if FUSE_VERSION >= 29
+	.read_buf	= cs1550_read_buf,
+	.write_buf	= cs1550_write_buf,
+#endif
+	.mknod	= cs1550_mknod,
+	.unlink = cs1550_unlink,
+	.truncate = cs1550_truncate,
+	.flush = cs1550_flush,
+	.fsync = cs1550_fsync,
+	.open	= cs1550_open,
+	.create	= cs1550_create,
+	.release = cs1550_release,
+	.init = cs1550_init,
+	.destroy = cs1550_destroy,
+};
+
+//.disk is opened here, before fuse_main daemonizes and changes directory,
+//so the single descriptor stays valid for the life of the mount
+int main(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	char timeouts[96];
+	int ret;
+
+	if(fuse_opt_parse(&args, &cs1550_opts, cs1550_fuse_opts, NULL) == -1)
+		return 1;
+
+	//put cache_timeout in front of the rest, so an entry_timeout and the like
+	//given on the command line still win
+	snprintf(timeouts, sizeof(timeouts),
+			"-oentry_timeout=%lu,negative_timeout=%lu,attr_timeout=%lu",
+			cs1550_opts.cache_timeout, cs1550_opts.cache_timeout,
+			cs1550_opts.cache_timeout);
+	if(fuse_opt_insert_arg(&args, 1, timeouts) == -1)
+		return 1;
+
+	if(cs1550_disk_open(".disk", cs1550_opts.cache_kb, cs1550_opts.block_size,
+			cs1550_opts.extents) < 0 || cs1550_load() < 0)
+		return 1;
+
+	ret = fuse_main(args.argc, args.argv, &hello_oper, NULL);
+	fuse_opt_free_args(&args);
+	return ret;
+}
+
+#else /* CS1550_LOWLEVEL */
+
+/*
+ * Low-level build (-DCS1550_LOWLEVEL). The kernel hands us inode numbers
+ * instead of paths, and they are made from where things live so nothing has
+ * to be looked up: the root is FUSE_ROOT_ID, the directory in root slot d is
+ * (d + 1) << 32 and the file in slot f of that directory is the directory's
+ * inode plus f + 1. A slot freed by unlink or rmdir is handed to the next
+ * name made, so entries also carry the generation of what is in the slot
+ * now. Every operation goes straight to the indexed entry,
+ * and the ones that change the namespace call the same slot-level code as
+ * the path-based ones with the parent locked throughout.
+ */
+
+#define	CS1550_INO_DIR(d)		((fuse_ino_t) ((d) + 1) << 32)
+#define	CS1550_INO_FILE(d, f)	(CS1550_INO_DIR(d) | (fuse_ino_t) ((f) + 1))
+
+//seconds the kernel may keep the attributes and names it is given, and
+//remember that a name does not exist (-o cache_timeout=N)
+#define	CS1550_LL_TIMEOUT ((double) cs1550_opts.cache_timeout)
+
+//root slot and file slot of an inode; file_loc is -1 for a directory
+static int cs1550_ino_split(fuse_ino_t ino, int *dir_loc, int *file_loc)
+{
+	*dir_loc = (int) (ino >> 32) - 1;
+	*file_loc = (int) (ino & 0xffffffff) - 1;
+	if(*dir_loc < 0 || *file_loc < -1)
+		return -ENOENT;
+	return 0;
+}
+
+/*
+ * Lock the root and the directory an inode belongs to for reading or
+ * writing, the same locks cs1550_lock_path takes. Returns the directory, or
+ * NULL with nothing held if it does not exist.
+ */
+static cs1550_dir_node *cs1550_ino_lock(int dir_loc, int write)
+{
+	pthread_rwlock_rdlock(&cs1550_root_lock);
+	if(dir_loc >= cs1550_root_nslots || cs1550_root_slots[dir_loc] == NULL)
+	{
+		pthread_rwlock_unlock(&cs1550_root_lock);
+		return NULL;
+	}
+	cs1550_dir_lock(cs1550_root_slots[dir_loc], write);
+	return cs1550_root_slots[dir_loc];
+}
+
+static int cs1550_ino_stat(fuse_ino_t ino, struct stat *stbuf)
+{
+	cs1550_dir_node *d;
+	int dir_loc, file_loc;
+	int ret = 0;
+
+	if(ino == FUSE_ROOT_ID)
+	{
+		cs1550_stat_dir(stbuf);
+		stbuf->st_ino = ino;
+		return 0;
+	}
+	if(cs1550_ino_split(ino, &dir_loc, &file_loc) < 0)
+		return -ENOENT;
+
+	d = cs1550_ino_lock(dir_loc, 0);
+	if(d == NULL)
+		return -ENOENT;
+	if(file_loc < 0)
+		cs1550_stat_dir(stbuf);
+	else if(cs1550_file_at(dir_loc, file_loc) == NULL)
+		ret = -ENOENT;
+	else
+	{
+		cs1550_file_node *node = cs1550_file_at(dir_loc, file_loc);
+
+		pthread_mutex_lock(&node->lock);
+		cs1550_stat_file(stbuf, node->fsize);
+		pthread_mutex_unlock(&node->lock);
+	}
+	cs1550_unlock_path(d);
+	stbuf->st_ino = ino;
+	return ret;
+}
+
+//copy name out as a directory name
+static int cs1550_ll_dname(const char *name, char *directory)
+{
+	size_t len = strlen(name);
+
+	if(len == 0)
+		return -ENOENT;
+	if(len > MAX_FILENAME)
+		return -ENAMETOOLONG;
+	memset(directory, 0, MAX_FILENAME + 1);
+	memcpy(directory, name, len);
+	return 0;
+}
+
+//find name in the directory parent and fill in the entry for it
+static int cs1550_ll_find(fuse_ino_t parent, const char *name, struct fuse_entry_param *e)
+{
+	char filename[MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1];
+	cs1550_dir_node *d;
+	int dir_loc, file_loc;
+
+	memset(e, 0, sizeof(*e));
+	e->attr_timeout = CS1550_LL_TIMEOUT;
+	e->entry_timeout = CS1550_LL_TIMEOUT;
+
+	if(parent == FUSE_ROOT_ID)
+	{
+		if(cs1550_ll_dname(name, filename) < 0)
+			return -ENOENT;
+		pthread_rwlock_rdlock(&cs1550_root_lock);
+		dir_loc = cs1550_find_dir_loc(filename);
+		if(dir_loc >= 0)
+			e->generation = cs1550_root_slots[dir_loc]->generation;
+		pthread_rwlock_unlock(&cs1550_root_lock);
+		if(dir_loc < 0)
+			return -ENOENT;
+		e->ino = CS1550_INO_DIR(dir_loc);
+		return cs1550_ino_stat(e->ino, &e->attr);
+	}
+
+	if(cs1550_ino_split(parent, &dir_loc, &file_loc) < 0 || file_loc >= 0)
+		return -ENOTDIR;
+	if(cs1550_split_name(name, filename, extension) < 0)
+		return -ENOENT;
+	d = cs1550_ino_lock(dir_loc, 0);
+	if(d == NULL)
+		return -ENOENT;
+	file_loc = cs1550_find_file_loc(dir_loc, filename, extension, NULL);
+	if(file_loc >= 0)
+		e->generation = cs1550_file_at(dir_loc, file_loc)->generation;
+	cs1550_unlock_path(d);
+	if(file_loc < 0)
+		return -ENOENT;
+	e->ino = CS1550_INO_FILE(dir_loc, file_loc);
+	return cs1550_ino_stat(e->ino, &e->attr);
+}
+
+static void cs1550_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	(void) userdata;
+
+	cs1550_init(conn);
+}
+
+static void cs1550_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct fuse_entry_param e;
+	int ret = cs1550_ll_find(parent, name, &e);
+
+	//an entry with no inode is cached as a negative one; mknod and mkdir
+	//come through the kernel, which replaces it
+	if(ret == -ENOENT && CS1550_LL_TIMEOUT > 0)
+	{
+		memset(&e, 0, sizeof(e));
+		e.entry_timeout = CS1550_LL_TIMEOUT;
+		fuse_reply_entry(req, &e);
+	}
+	else if(ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+static void cs1550_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct stat st;
+	int ret = cs1550_ino_stat(ino, &st);
+
+	(void) fi;
+
+	if(ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_attr(req, &st, CS1550_LL_TIMEOUT);
+}
+
+//only the size can be changed; everything else is fixed
+static void cs1550_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+		int to_set, struct fuse_file_info *fi)
+{
+	struct stat st;
+	int ret = 0;
+
+	if(to_set & FUSE_SET_ATTR_SIZE)
+	{
+		cs1550_handle tmp, *h;
+		cs1550_dir_node *d;
+		int dir_loc, file_loc;
+
+		if(attr->st_size < 0)
+			ret = -EINVAL;
+		else if(fi != NULL && fi->fh != 0)
+		{
+			cs1550_get_handle(NULL, fi, &tmp, &h);
+			ret = cs1550_truncate_locked(h, attr->st_size);
+			cs1550_put_handle(h);
+		}
+		else if(ino == FUSE_ROOT_ID)
+			ret = -EISDIR;
+		else if(cs1550_ino_split(ino, &dir_loc, &file_loc) < 0)
+			ret = -ENOENT;
+		else if(file_loc < 0)
+			ret = -EISDIR;
+		else if((d = cs1550_ino_lock(dir_loc, 0)) == NULL)
+			ret = -ENOENT;
+		else if(cs1550_file_at(dir_loc, file_loc) == NULL)
+		{
+			cs1550_unlock_path(d);
+			ret = -ENOENT;
+		}
+		else
+		{
+			//a throwaway handle holding the locks, as cs1550_get_handle
+			//makes for a path
+			cs1550_handle_init(&tmp, dir_loc, file_loc);
+			tmp.path_locked = 1;
+			pthread_mutex_lock(&tmp.node->lock);
+			ret = cs1550_truncate_locked(&tmp, attr->st_size);
+			cs1550_put_handle(&tmp);
+		}
+	}
+	if(ret == 0)
+		ret = cs1550_ino_stat(ino, &st);
+
+	if(ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_attr(req, &st, CS1550_LL_TIMEOUT);
+}
+
+static void cs1550_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+		off_t off, struct fuse_file_info *fi)
+{
+	cs1550_dir_node *d = NULL;
+	int dir_loc = -1, file_loc, nslots, i;
+	char *buf = malloc(size);
+	size_t len = 0;
+
+	(void) fi;
+
+	if(buf == NULL)
+	{
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	if(ino == FUSE_ROOT_ID)
+	{
+		pthread_rwlock_rdlock(&cs1550_root_lock);
+		nslots = cs1550_root_nslots;
+	}
+	else if(cs1550_ino_split(ino, &dir_loc, &file_loc) < 0 || file_loc >= 0
+			|| (d = cs1550_ino_lock(dir_loc, 0)) == NULL)
+	{
+		free(buf);
+		fuse_reply_err(req, file_loc >= 0 ? ENOTDIR : ENOENT);
+		return;
+	}
+	else
+		nslots = d->nslots;
+
+	//entry i is "." and ".." for i < 2 and slot i - 2 after that; the
+	//offset handed back with it, where the next call resumes, is i + 1
+	for(i = off; i < nslots + 2; i++)
+	{
+		char name[MAX_FILENAME + MAX_EXTENSION + 2];
+		struct stat st;
+		size_t need;
+
+		memset(&st, 0, sizeof(st));
+		if(i < 2)
+		{
+			strcpy(name, i == 0 ? "." : "..");
+			st.st_ino = ino;
+			st.st_mode = S_IFDIR;
+		}
+		else if(d == NULL)
+		{
+			if(cs1550_root_slots[i - 2] == NULL)
+				continue;
+			strcpy(name, cs1550_root_slots[i - 2]->dname);
+			st.st_ino = CS1550_INO_DIR(i - 2);
+			st.st_mode = S_IFDIR;
+		}
+		else
+		{
+			if(d->file_slots[i - 2] == NULL)
+				continue;
+			sprintf(name, "%s.%s", d->file_slots[i - 2]->fname, d->file_slots[i - 2]->fext);
+			st.st_ino = CS1550_INO_FILE(dir_loc, i - 2);
+			st.st_mode = S_IFREG;
+		}
+
+		need = fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+		if(len + need > size)
+			break;
+		fuse_add_direntry(req, buf + len, size - len, name, &st, i + 1);
+		len += need;
+	}
+
+	if(d != NULL)
+		cs1550_unlock_path(d);
+	else
+		pthread_rwlock_unlock(&cs1550_root_lock);
+	fuse_reply_buf(req, buf, len);
+	free(buf);
+}
+
+//the entry for the empty file or directory just made at ino
+static void cs1550_ll_made(struct fuse_entry_param *e, fuse_ino_t ino,
+		unsigned long generation, int dir)
+{
+	memset(e, 0, sizeof(*e));
+	e->ino = ino;
+	e->generation = generation;
+	e->attr_timeout = CS1550_LL_TIMEOUT;
+	e->entry_timeout = CS1550_LL_TIMEOUT;
+	if(dir)
+		cs1550_stat_dir(&e->attr);
+	else
+		cs1550_stat_file(&e->attr, 0);
+	e->attr.st_ino = ino;
+}
+
+static void cs1550_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	struct fuse_entry_param e;
+	char directory[MAX_FILENAME + 1];
+	int ret = parent == FUSE_ROOT_ID ? 0 : -EPERM;
+
+	(void) mode;
+
+	if(ret == 0)
+		ret = cs1550_ll_dname(name, directory);
+	if(ret == 0)
+	{
+		pthread_rwlock_wrlock(&cs1550_root_lock);
+		ret = cs1550_mkdir_name(directory);
+		if(ret >= 0)
+			cs1550_ll_made(&e, CS1550_INO_DIR(ret),
+					cs1550_root_slots[ret]->generation, 1);
+		pthread_rwlock_unlock(&cs1550_root_lock);
+	}
+	if(ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+/*
+ * Make name in the directory parent and, if fi is not NULL, open it, all
+ * with the directory locked for writing. Returns the new file's entry.
+ */
+static int cs1550_ll_mknod_in(fuse_ino_t parent, const char *name,
+		struct fuse_file_info *fi, struct fuse_entry_param *e)
+{
+	char filename[MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1];
+	cs1550_dir_node *d;
+	int dir_loc, file_loc;
+	int ret;
+
+	if(parent == FUSE_ROOT_ID)
+		return -EPERM;
+	if(cs1550_ino_split(parent, &dir_loc, &file_loc) < 0 || file_loc >= 0)
+		return -ENOTDIR;
+	ret = cs1550_split_name(name, filename, extension);
+	if(ret < 0)
+		return ret;
+
+	d = cs1550_ino_lock(dir_loc, 1);
+	if(d == NULL)
+		return -ENOENT;
+	pthread_mutex_lock(&d->ent_lock);
+	file_loc = cs1550_mknod_in(dir_loc, filename, extension);
+	pthread_mutex_unlock(&d->ent_lock);
+	ret = file_loc < 0 ? file_loc : 0;
+	if(ret == 0 && fi != NULL)
+		ret = cs1550_open_slot(dir_loc, file_loc, fi);
+	if(ret == 0)
+		cs1550_ll_made(e, CS1550_INO_FILE(dir_loc, file_loc),
+				cs1550_file_at(dir_loc, file_loc)->generation, 0);
+	cs1550_unlock_path(d);
+	return ret;
+}
+
+static void cs1550_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+		mode_t mode, dev_t rdev)
+{
+	struct fuse_entry_param e;
+	int ret = cs1550_ll_mknod_in(parent, name, NULL, &e);
+
+	(void) mode;
+	(void) rdev;
+
+	if(ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+static void cs1550_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+		mode_t mode, struct fuse_file_info *fi)
+{
+	struct fuse_entry_param e;
+	int ret = cs1550_ll_mknod_in(parent, name, fi, &e);
+
+	(void) mode;
+
+	if(ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_create(req, &e, fi);
+}
+
+static void cs1550_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	char filename[MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1];
+	cs1550_dir_node *d;
+	int dir_loc, file_loc;
+	int ret;
+
+	if(parent == FUSE_ROOT_ID)
+	{
+		//only directories live in the root
+		ret = -ENOENT;
+		if(cs1550_ll_dname(name, filename) == 0)
+		{
+			pthread_rwlock_rdlock(&cs1550_root_lock);
+			if(cs1550_find_dir_loc(filename) >= 0)
+				ret = -EISDIR;
+			pthread_rwlock_unlock(&cs1550_root_lock);
+		}
+	}
+	else if(cs1550_ino_split(parent, &dir_loc, &file_loc) < 0 || file_loc >= 0)
+		ret = -ENOTDIR;
+	else if(cs1550_split_name(name, filename, extension) < 0)
+		ret = -ENOENT;
+	else if((d = cs1550_ino_lock(dir_loc, 1)) == NULL)
+		ret = -ENOENT;
+	else
+	{
+		ret = cs1550_unlink_in(dir_loc, filename, extension);
+		cs1550_unlock_path(d);
+	}
+	fuse_reply_err(req, -ret);
+}
+
+static void cs1550_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	char directory[MAX_FILENAME + 1];
+	int ret = parent == FUSE_ROOT_ID ? 0 : -ENOTDIR;
+
+	if(ret == 0 && cs1550_ll_dname(name, directory) < 0)
+		ret = -ENOENT;
+	if(ret == 0)
+	{
+		pthread_rwlock_wrlock(&cs1550_root_lock);
+		ret = cs1550_find_dir_loc(directory);
+		ret = ret < 0 ? -ENOENT : cs1550_rmdir_loc(ret);
+		pthread_rwlock_unlock(&cs1550_root_lock);
+	}
+	fuse_reply_err(req, -ret);
+}
+
+static void cs1550_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	cs1550_dir_node *d;
+	int dir_loc, file_loc;
+	int ret = -ENOENT;
+
+	if(ino == FUSE_ROOT_ID)
+		ret = -EISDIR;
+	else if(cs1550_ino_split(ino, &dir_loc, &file_loc) < 0)
+		ret = -ENOENT;
+	else if(file_loc < 0)
+		ret = -EISDIR;
+	else if((d = cs1550_ino_lock(dir_loc, 0)) != NULL)
+	{
+		if(cs1550_file_at(dir_loc, file_loc) != NULL)
+			ret = cs1550_open_slot(dir_loc, file_loc, fi);
+		cs1550_unlock_path(d);
+	}
+
+	if(ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_open(req, fi);
+}
+
+#if FUSE_VERSION >= 29
+//the chain's blocks are spliced from .disk, as with read_buf
+static void cs1550_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+		off_t off, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec *bv;
+	int ret = cs1550_read_buf(NULL, &bv, size, off, fi);
+
+	(void) ino;
+
+	if(ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+	{
+		fuse_reply_data(req, bv, FUSE_BUF_SPLICE_MOVE);
+		free(bv);
+	}
+}
+
+static void cs1550_ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+		struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi)
+{
+	int ret = cs1550_write_buf(NULL, bufv, off, fi);
+
+	(void) ino;
+
+	if(ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_write(req, ret);
+}
+#else
+static void cs1550_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+		off_t off, struct fuse_file_info *fi)
+{
+	char *buf = malloc(size);
+	int ret;
+
+	(void) ino;
+
+	if(buf == NULL)
+	{
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	ret = cs1550_read(NULL, buf, size, off, fi);
+	if(ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_buf(req, buf, ret);
+	free(buf);
+}
+#endif
+
+static void cs1550_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+		size_t size, off_t off, struct fuse_file_info *fi)
+{
+	int ret = cs1550_write(NULL, buf, size, off, fi);
+
+	(void) ino;
+
+	if(ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_write(req, ret);
+}
+
+static void cs1550_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void) ino;
+
+	fuse_reply_err(req, -cs1550_flush(NULL, fi));
+}
+
+static void cs1550_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void) ino;
+
+	fuse_reply_err(req, -cs1550_release(NULL, fi));
+}
+
+static void cs1550_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+		struct fuse_file_info *fi)
+{
+	(void) ino;
+
+	fuse_reply_err(req, -cs1550_fsync(NULL, datasync, fi));
+}
+
+static struct fuse_lowlevel_ops cs1550_ll_oper = {
+	.init		= cs1550_ll_init,
+	.destroy	= cs1550_destroy,
+	.lookup		= cs1550_ll_lookup,
+	.getattr	= cs1550_ll_getattr,
+	.setattr	= cs1550_ll_setattr,
+	.readdir	= cs1550_ll_readdir,
+	.mkdir		= cs1550_ll_mkdir,
+	.rmdir		= cs1550_ll_rmdir,
+	.mknod		= cs1550_ll_mknod,
+	.unlink		= cs1550_ll_unlink,
+	.create		= cs1550_ll_create,
+	.open		= cs1550_ll_open,
+	.read		= cs1550_ll_read,
+	.write		= cs1550_ll_write,
+#if FUSE_VERSION >= 29
+	.write_buf	= cs1550_ll_write_buf,
+#endif
+	.flush		= cs1550_ll_flush,
+	.release	= cs1550_ll_release,
+	.fsync		= cs1550_ll_fsync,
+};
+
+//the same start up as fuse_main, done by hand to run a low-level session
+int main(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_session *se;
+	struct fuse_chan *ch;
+	char *mountpoint;
+	int multithreaded, foreground;
+	int err = -1;
+
+	if(fuse_opt_parse(&args, &cs1550_opts, cs1550_fuse_opts, NULL) == -1 ||
+	   fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1)
+		return 1;
+
+	if(cs1550_disk_open(".disk", cs1550_opts.cache_kb, cs1550_opts.block_size,
+			cs1550_opts.extents) < 0 || cs1550_load() < 0)
+		return 1;
+
+	ch = fuse_mount(mountpoint, &args);
+	if(ch != NULL)
+	{
+		se = fuse_lowlevel_new(&args, &cs1550_ll_oper, sizeof(cs1550_ll_oper), NULL);
+		if(se != NULL)
+		{
+			if(fuse_set_signal_handlers(se) != -1)
+			{
+				fuse_session_add_chan(se, ch);
+#if FUSE_VERSION >= 28
+				fuse_daemonize(foreground);
+#else
+				if(!foreground && daemon(0, 0) < 0)
+					printf("could not run in the background\n");
+#endif
+				if(multithreaded)
+					err = fuse_session_loop_mt(se);
+				else
+					err = fuse_session_loop(se);
+				fuse_remove_signal_handlers(se);
+				fuse_session_remove_chan(ch);
+			}
+			fuse_session_destroy(se);
+		}
+		fuse_unmount(mountpoint, ch);
+	}
+	fuse_opt_free_args(&args);
+	return err ? 1 : 0;
 }
+
+#endif /* CS1550_LOWLEVEL */